@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+
+from vosk import Model, KaldiRecognizer, SetAsyncThreads
+import sys
+import os
+import wave
+
+if not os.path.exists("model"):
+    print ("Please download the model from https://alphacephei.com/vosk/models and unpack as 'model' in the current folder.")
+    exit (1)
+
+wf = wave.open(sys.argv[1], "rb")
+if wf.getnchannels() != 1 or wf.getsampwidth() != 2 or wf.getcomptype() != "NONE":
+    print ("Audio file must be WAV format mono PCM.")
+    exit (1)
+
+# Threads shared by all recognizers, set before the first audio is queued
+SetAsyncThreads(2)
+
+model = Model("model")
+rec = KaldiRecognizer(model, wf.getframerate())
+
+# Results come from the library threads, 0 is partial, 1 endpoint and 2 final
+def on_result(type, result):
+    print(type, result)
+
+rec.SetResultCallback(on_result)
+
+# Audio is queued and decoded in the background, the calls return immediately
+while True:
+    data = wf.readframes(4000)
+    if len(data) == 0:
+        break
+    rec.AcceptWaveformAsync(data)
+
+rec.FinishAsync()
+rec.WaitAsync()
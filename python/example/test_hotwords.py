@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+
+from vosk import Model, KaldiRecognizer
+import sys
+import os
+import wave
+
+if not os.path.exists("model"):
+    print ("Please download the model from https://alphacephei.com/vosk/models and unpack as 'model' in the current folder.")
+    exit (1)
+
+wf = wave.open(sys.argv[1], "rb")
+if wf.getnchannels() != 1 or wf.getsampwidth() != 2 or wf.getcomptype() != "NONE":
+    print ("Audio file must be WAV format mono PCM.")
+    exit (1)
+
+model = Model("model")
+rec = KaldiRecognizer(model, wf.getframerate())
+
+# Phrases to prefer in the final results, as a string or with a boost in graph cost units
+rec.SetHotwords('["one zero zero zero", {"phrase": "nine oh two", "boost": 8}]')
+
+while True:
+    data = wf.readframes(4000)
+    if len(data) == 0:
+        break
+    if rec.AcceptWaveform(data):
+        print(rec.Result())
+    else:
+        print(rec.PartialResult())
+
+print(rec.FinalResult())
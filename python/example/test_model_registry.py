@@ -0,0 +1,36 @@
+#!/usr/bin/env python3
+
+from vosk import Model, ModelRegistry, KaldiRecognizer
+import sys
+import os
+import wave
+
+if not os.path.exists("model"):
+    print ("Please download the model from https://alphacephei.com/vosk/models and unpack as 'model' in the current folder.")
+    exit (1)
+
+wf = wave.open(sys.argv[1], "rb")
+if wf.getnchannels() != 1 or wf.getsampwidth() != 2 or wf.getcomptype() != "NONE":
+    print ("Audio file must be WAV format mono PCM.")
+    exit (1)
+
+# Recognizers created from the registry follow the model swapped into it
+registry = ModelRegistry(Model("model"))
+rec = KaldiRecognizer(registry, wf.getframerate())
+
+swapped = False
+while True:
+    data = wf.readframes(4000)
+    if len(data) == 0:
+        break
+    if rec.AcceptWaveform(data):
+        print(rec.Result())
+        if not swapped:
+            # An updated model would be loaded here, the next utterance starts with it
+            print("Swapped to version", registry.Swap(Model("model")))
+            swapped = True
+    else:
+        print(rec.PartialResult())
+
+print(rec.FinalResult())
+print("Registry version", registry.Version())
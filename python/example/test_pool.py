@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+
+from vosk import Model, RecognizerPool
+import sys
+import os
+import wave
+
+if not os.path.exists("model"):
+    print ("Please download the model from https://alphacephei.com/vosk/models and unpack as 'model' in the current folder.")
+    exit (1)
+
+model = Model("model")
+
+# Recognizers are prepared in advance and reused instead of created for every file
+pool = RecognizerPool(model, 16000, 2)
+
+for fname in sys.argv[1:]:
+    wf = wave.open(fname, "rb")
+    if wf.getnchannels() != 1 or wf.getsampwidth() != 2 or wf.getcomptype() != "NONE" or wf.getframerate() != 16000:
+        print ("Audio file must be WAV format mono PCM 16kHz.")
+        exit (1)
+
+    rec = pool.Acquire()
+    while True:
+        data = wf.readframes(4000)
+        if len(data) == 0:
+            break
+        if rec.AcceptWaveform(data):
+            print(rec.Result())
+
+    print(fname, rec.FinalResult())
+    # Don't use the recognizer after release
+    pool.Release(rec)
@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+
+from vosk import Model, KaldiRecognizer
+import sys
+import os
+import wave
+
+if not os.path.exists("model"):
+    print ("Please download the model from https://alphacephei.com/vosk/models and unpack as 'model' in the current folder.")
+    exit (1)
+
+wf = wave.open(sys.argv[1], "rb")
+if wf.getnchannels() != 1 or wf.getsampwidth() != 2 or wf.getcomptype() != "NONE":
+    print ("Audio file must be WAV format mono PCM.")
+    exit (1)
+
+model = Model("model")
+rec = KaldiRecognizer(model, wf.getframerate())
+rec.SetMaxAlternatives(3)
+
+# Text and words of the last result without parsing the JSON
+def print_result():
+    alternative = 0
+    while True:
+        text = rec.ResultText(alternative)
+        if text is None:
+            break
+        print(alternative, text)
+        for word, start, end, conf in rec.ResultWords(alternative):
+            print("    %s %.2f-%.2f %.2f" % (word, start, end, conf))
+        alternative += 1
+
+while True:
+    data = wf.readframes(4000)
+    if len(data) == 0:
+        break
+    if rec.AcceptWaveform(data):
+        rec.Result()
+        print_result()
+
+rec.FinalResult()
+print_result()
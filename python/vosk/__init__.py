@@ -1,5 +1,6 @@
 import os
 import sys
+import json
 
 from .vosk_cffi import ffi as _ffi
 
@@ -22,8 +23,11 @@ _c = open_dll()
 
 class Model(object):
 
-    def __init__(self, model_path):
-        self._handle = _c.vosk_model_new(model_path.encode('utf-8'))
+    def __init__(self, model_path, am_model=None):
+        if am_model is None:
+            self._handle = _c.vosk_model_new(model_path.encode('utf-8'))
+        else:
+            self._handle = _c.vosk_model_new_graph(am_model._handle, model_path.encode('utf-8'))
 
         if self._handle == _ffi.NULL:
             raise Exception("Failed to create a model")
@@ -34,6 +38,12 @@ class Model(object):
     def vosk_model_find_word(self, word):
         return _c.vosk_model_find_word(self._handle, word.encode('utf-8'))
 
+    def GetStats(self):
+        size = _c.vosk_model_get_stats(self._handle, _ffi.NULL, 0) + 1
+        buf = _ffi.new("char[]", size)
+        _c.vosk_model_get_stats(self._handle, buf, size)
+        return _ffi.string(buf).decode('utf-8')
+
 class SpkModel(object):
 
     def __init__(self, model_path):
@@ -45,10 +55,31 @@ class SpkModel(object):
     def __del__(self):
         _c.vosk_spk_model_free(self._handle)
 
+class ModelRegistry(object):
+
+    def __init__(self, model):
+        self._handle = _c.vosk_model_registry_new(model._handle)
+
+        if self._handle == _ffi.NULL:
+            raise Exception("Failed to create a model registry")
+
+    def __del__(self):
+        _c.vosk_model_registry_free(self._handle)
+
+    def Swap(self, model):
+        return _c.vosk_model_registry_swap(self._handle, model._handle)
+
+    def Version(self):
+        return _c.vosk_model_registry_version(self._handle)
+
 class KaldiRecognizer(object):
 
     def __init__(self, *args):
-        if len(args) == 2:
+        if len(args) == 2 and type(args[0]) is ModelRegistry:
+            self._handle = _c.vosk_recognizer_new_registry(args[0]._handle, args[1])
+        elif len(args) == 3 and type(args[0]) is ModelRegistry and type(args[2]) is str:
+            self._handle = _c.vosk_recognizer_new_registry_grm(args[0]._handle, args[1], args[2].encode('utf-8'))
+        elif len(args) == 2:
             self._handle = _c.vosk_recognizer_new(args[0]._handle, args[1])
         elif len(args) == 3 and type(args[2]) is SpkModel:
             self._handle = _c.vosk_recognizer_new_spk(args[0]._handle, args[1], args[2]._handle)
@@ -69,6 +100,27 @@ class KaldiRecognizer(object):
     def SetWords(self, enable_words):
         _c.vosk_recognizer_set_words(self._handle, 1 if enable_words else 0)
 
+    def SetIncrementalPartial(self, enable_incremental):
+        _c.vosk_recognizer_set_incremental_partial(self._handle, 1 if enable_incremental else 0)
+
+    def SetRescoringPruning(self, beam, max_arcs):
+        _c.vosk_recognizer_set_rescoring_pruning(self._handle, beam, max_arcs)
+
+    def SetChunkSize(self, chunk_size):
+        _c.vosk_recognizer_set_chunk_size(self._handle, chunk_size)
+
+    def SetSilenceWeightInterval(self, interval):
+        _c.vosk_recognizer_set_silence_weight_interval(self._handle, interval)
+
+    def SetSpkWindow(self, window, shift):
+        _c.vosk_recognizer_set_spk_window(self._handle, window, shift)
+
+    def SetVad(self, vad):
+        _c.vosk_recognizer_set_vad(self._handle, 1 if vad else 0)
+
+    def SetHotwords(self, hotwords):
+        _c.vosk_recognizer_set_hotwords(self._handle, hotwords.encode('utf-8') if hotwords else _ffi.NULL)
+
     def SetSpkModel(self, spk_model):
         _c.vosk_recognizer_set_spk_model(self._handle, spk_model._handle)
 
@@ -87,14 +139,100 @@ class KaldiRecognizer(object):
     def FinalResult(self):
         return _ffi.string(_c.vosk_recognizer_final_result(self._handle)).decode('utf-8')
 
+    def ResultText(self, alternative=0):
+        ptr = _c.vosk_recognizer_result_text(self._handle, alternative)
+        return _ffi.string(ptr).decode('utf-8') if ptr != _ffi.NULL else None
+
+    def ResultWords(self, alternative=0):
+        num_words = _ffi.new("int *")
+        words = _c.vosk_recognizer_result_words(self._handle, alternative, num_words)
+        return [(_ffi.string(w.word).decode('utf-8'), w.start, w.end, w.conf)
+                for w in (words[i] for i in range(num_words[0]))]
+
+    def ResultSpk(self):
+        dim = _ffi.new("int *")
+        num_frames = _ffi.new("int *")
+        spk = _c.vosk_recognizer_result_spk(self._handle, dim, num_frames)
+        return list(_ffi.unpack(spk, dim[0])) if dim[0] else None
+
+    def SetStats(self, enable):
+        _c.vosk_recognizer_set_stats(self._handle, 1 if enable else 0)
+
+    def GetStats(self):
+        return _ffi.string(_c.vosk_recognizer_get_stats(self._handle)).decode('utf-8')
+
     def Reset(self):
         return _c.vosk_recognizer_reset(self._handle)
 
+    def SetResultCallback(self, callback):
+        # Called from the library threads with the type and the JSON of the result
+        @_ffi.callback("void(void *, int, const char *)")
+        def result_callback(user_data, type, result):
+            callback(type, _ffi.string(result).decode('utf-8'))
+        # Keep the callback alive as long as the recognizer may call it
+        self._callback = result_callback
+        _c.vosk_recognizer_set_callback(self._handle, result_callback, _ffi.NULL)
+
+    def AcceptWaveformAsync(self, data):
+        res = _c.vosk_recognizer_accept_waveform_async(self._handle, data, len(data))
+        if res < 0:
+            raise Exception("Failed to queue waveform")
+
+    def FinishAsync(self):
+        res = _c.vosk_recognizer_finish_async(self._handle)
+        if res < 0:
+            raise Exception("Failed to queue the end of the stream")
+
+    def WaitAsync(self):
+        _c.vosk_recognizer_wait_async(self._handle)
+
+
+class RecognizerPool(object):
+
+    def __init__(self, *args):
+        if len(args) == 3:
+            self._handle = _c.vosk_recognizer_pool_new(args[0]._handle, args[1], args[2])
+        elif len(args) == 4 and type(args[3]) is str:
+            self._handle = _c.vosk_recognizer_pool_new_grm(args[0]._handle, args[1], args[2], args[3].encode('utf-8'))
+        else:
+            raise TypeError("Unknown arguments")
+
+        if self._handle == _ffi.NULL:
+            raise Exception("Failed to create a recognizer pool")
+
+    def __del__(self):
+        _c.vosk_recognizer_pool_free(self._handle)
+
+    def Acquire(self):
+        handle = _c.vosk_recognizer_pool_acquire(self._handle)
+        if handle == _ffi.NULL:
+            raise Exception("Failed to create a recognizer")
+        rec = KaldiRecognizer.__new__(KaldiRecognizer)
+        rec._handle = handle
+        return rec
+
+    def Release(self, rec):
+        _c.vosk_recognizer_pool_release(self._handle, rec._handle)
+        # The pool owns the recognizer now, freeing NULL is a no-op
+        rec._handle = _ffi.NULL
+
 
 def SetLogLevel(level):
     return _c.vosk_set_log_level(level)
 
 
+def SetAsyncThreads(num_threads):
+    _c.vosk_set_async_threads(num_threads)
+
+
+def SetAllocatorArenas(arenas):
+    _c.vosk_set_allocator_arenas(arenas)
+
+
+def ReleaseMemory():
+    _c.vosk_release_memory()
+
+
 def GpuInit():
     _c.vosk_gpu_init()
 
@@ -104,8 +242,9 @@ def GpuThreadInit():
 
 class BatchRecognizer(object):
 
-    def __init__(self, *args):
-        self._handle = _c.vosk_batch_recognizer_new()
+    def __init__(self, model_path="model", config=None):
+        self._handle = _c.vosk_batch_recognizer_new(model_path.encode('utf-8'),
+                json.dumps(config).encode('utf-8') if config else _ffi.NULL)
 
         if self._handle == _ffi.NULL:
             raise Exception("Failed to create a recognizer")
@@ -122,6 +261,9 @@ class BatchRecognizer(object):
         _c.vosk_batch_recognizer_pop(self._handle, uid)
         return res
 
+    def NextResult(self, timeout_ms):
+        return _c.vosk_batch_recognizer_next_result(self._handle, timeout_ms)
+
     def FinishStream(self, uid):
         _c.vosk_batch_recognizer_finish_stream(self._handle, uid)
 
@@ -0,0 +1,73 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "async_pool.h"
+
+#include <algorithm>
+
+AsyncPool &AsyncPool::Get()
+{
+    // Never destroyed, worker threads may still run when static
+    // objects are destructed at exit
+    static AsyncPool *pool = new AsyncPool();
+    return *pool;
+}
+
+AsyncPool::AsyncPool()
+{
+    num_threads_ = std::max(1u, std::thread::hardware_concurrency());
+}
+
+void AsyncPool::SetNumThreads(int num_threads)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_threads_ = std::max(num_threads, 1);
+    if (!threads_.empty()) {
+        StartThreads();
+    }
+}
+
+void AsyncPool::Schedule(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (threads_.empty()) {
+            StartThreads();
+        }
+        tasks_.push_back(std::move(task));
+    }
+    cond_.notify_one();
+}
+
+// Called with the mutex locked
+void AsyncPool::StartThreads()
+{
+    while ((int)threads_.size() < num_threads_) {
+        threads_.emplace_back(&AsyncPool::Worker, this);
+    }
+}
+
+void AsyncPool::Worker()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() { return !tasks_.empty(); });
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,47 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_ASYNC_POOL_H
+#define VOSK_ASYNC_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Process-wide pool of threads running tasks of the asynchronous recognizers.
+// Threads are started on the first task, the pool lives until the process exits.
+class AsyncPool {
+    public:
+        static AsyncPool &Get();
+
+        // Only grows the pool, running threads are never stopped
+        void SetNumThreads(int num_threads);
+        void Schedule(std::function<void()> task);
+
+    private:
+        AsyncPool();
+        void StartThreads();
+        void Worker();
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::deque<std::function<void()> > tasks_;
+        std::vector<std::thread> threads_;
+        int num_threads_;
+};
+
+#endif /* VOSK_ASYNC_POOL_H */
@@ -0,0 +1,109 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_AUDIO_UTILS_H
+#define VOSK_AUDIO_UTILS_H
+
+#include <math.h>
+#include <stddef.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Converts 16-bit PCM samples to floats without scaling, the input
+// doesn't need to be aligned. SIMD is used when enabled by the compiler.
+inline void ConvertSamples(const short *in, float *out, size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(in + i + 8));
+        _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(lo)));
+        _mm256_storeu_ps(out + i + 8, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(hi)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+        // Sign extension, interleave with itself and shift the copy out
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(out + i, _mm_cvtepi32_ps(lo));
+        _mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(hi));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t x = vld1q_s16(in + i);
+        vst1q_f32(out + i, vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))));
+        vst1q_f32(out + i + 4, vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = in[i];
+    }
+}
+
+// Double precision Kaldi builds
+inline void ConvertSamples(const short *in, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        out[i] = in[i];
+    }
+}
+
+// Energy based speech detector for 16-bit range samples. The noise floor
+// follows quiet frames quickly and loud ones slowly, so it settles on the
+// background level of the call. A frame is speech when it is well above
+// the floor and above an absolute minimum level.
+class EnergyVad {
+    public:
+        EnergyVad(float margin_db = 9.0, float min_db = 40.0) :
+            margin_db_(margin_db), min_db_(min_db) {
+            Reset();
+        }
+
+        // The floor starts low, so a stream which opens with speech is
+        // not taken for noise, the floor rises to the noise level slowly
+        void Reset() {
+            floor_db_ = min_db_ - margin_db_;
+        }
+
+        template <typename Real>
+        bool IsSpeech(const Real *x, size_t n) {
+            if (n == 0)
+                return false;
+            double energy = 0;
+            for (size_t i = 0; i < n; i++) {
+                energy += (double)x[i] * x[i];
+            }
+            float db = 10 * log10(energy / n + 1.0);
+
+            if (db < floor_db_) {
+                floor_db_ += 0.1f * (db - floor_db_);
+            } else {
+                floor_db_ += 0.002f * (db - floor_db_);
+            }
+            return db > floor_db_ + margin_db_ && db > min_db_;
+        }
+
+    private:
+        float margin_db_;
+        float min_db_;
+        float floor_db_;
+};
+
+#endif /* VOSK_AUDIO_UTILS_H */
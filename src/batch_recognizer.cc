@@ -17,44 +17,81 @@
 #include "fstext/fstext-utils.h"
 #include "lat/sausages.h"
 #include "json.h"
+#include "json_writer.h"
+#include "audio_utils.h"
 
 #include <sys/stat.h>
+#include <algorithm>
 
 using namespace fst;
 using namespace kaldi::nnet3;
 using CorrelationID = CudaOnlinePipelineDynamicBatcher::CorrelationID;
 
-BatchRecognizer::BatchRecognizer() {
+// Returns the number from the JSON config or the default if it is missing
+static double GetConfigNumber(json::JSON &config, const char *key, double default_value)
+{
+    if (!config.hasKey(key)) {
+        return default_value;
+    }
+    json::JSON &value = config[key];
+    if (value.JSONType() == json::JSON::Class::Integral) {
+        return value.ToInt();
+    }
+    if (value.JSONType() == json::JSON::Class::Floating) {
+        return value.ToFloat();
+    }
+    KALDI_ERR << "Expecting number for '" << key << "' in batch recognizer config";
+    return default_value;
+}
+
+BatchRecognizer::BatchRecognizer() : BatchRecognizer("model", nullptr) {
+}
+
+BatchRecognizer::BatchRecognizer(const char *model_path, const char *config) {
     BatchedThreadedNnet3CudaOnlinePipelineConfig batched_decoder_config;
+    CudaOnlinePipelineDynamicBatcherConfig dynamic_batcher_config;
+
+    string model_path_str(model_path);
+
+    json::JSON obj;
+    if (config && *config) {
+        obj = json::JSON::Load(config);
+        if (obj.JSONType() != json::JSON::Class::Object) {
+            KALDI_ERR << "Expecting JSON object as batch recognizer config, got: '" << config << "'";
+        }
+    }
 
     kaldi::ParseOptions po("something");
     batched_decoder_config.Register(&po);
-    po.ReadConfigFile("model/conf/model.conf");
+    po.ReadConfigFile(model_path_str + "/conf/model.conf");
 
-    batched_decoder_config.num_worker_threads = -1;
-    batched_decoder_config.max_batch_size = 32;
-    batched_decoder_config.num_channels = 600;
+    batched_decoder_config.num_worker_threads = GetConfigNumber(obj, "num_worker_threads", -1);
+    batched_decoder_config.max_batch_size = GetConfigNumber(obj, "max_batch_size", 32);
+    batched_decoder_config.num_channels = GetConfigNumber(obj, "num_channels", 600);
     batched_decoder_config.reset_on_endpoint = true;
     batched_decoder_config.use_gpu_feature_extraction = true;
 
     batched_decoder_config.feature_opts.feature_type = "mfcc";
-    batched_decoder_config.feature_opts.mfcc_config = "model/conf/mfcc.conf";
-    batched_decoder_config.feature_opts.ivector_extraction_config = "model/conf/ivector.conf";
-    batched_decoder_config.decoder_opts.max_active = 7000;
-    batched_decoder_config.decoder_opts.default_beam = 13.0;
-    batched_decoder_config.decoder_opts.lattice_beam = 6.0;
+    batched_decoder_config.feature_opts.mfcc_config = model_path_str + "/conf/mfcc.conf";
+    batched_decoder_config.feature_opts.ivector_extraction_config = model_path_str + "/conf/ivector.conf";
+    batched_decoder_config.decoder_opts.max_active = GetConfigNumber(obj, "max_active", 7000);
+    batched_decoder_config.decoder_opts.default_beam = GetConfigNumber(obj, "beam", 13.0);
+    batched_decoder_config.decoder_opts.lattice_beam = GetConfigNumber(obj, "lattice_beam", 6.0);
     batched_decoder_config.compute_opts.acoustic_scale = 1.0;
     batched_decoder_config.compute_opts.frame_subsampling_factor = 3;
-    batched_decoder_config.compute_opts.frames_per_chunk = 51;
+    batched_decoder_config.compute_opts.frames_per_chunk = GetConfigNumber(obj, "frames_per_chunk", 51);
+
+    dynamic_batcher_config.dynamic_batcher_timeout_in_seconds = GetConfigNumber(obj,
+            "batcher_timeout", dynamic_batcher_config.dynamic_batcher_timeout_in_seconds);
 
     struct stat buffer;
 
-    string nnet3_rxfilename_ = "model/am/final.mdl";
-    string hclg_fst_rxfilename_ = "model/graph/HCLG.fst";
-    string word_syms_rxfilename_ = "model/graph/words.txt";
-    string winfo_rxfilename_ = "model/graph/phones/word_boundary.int";
-    string std_fst_rxfilename_ = "model/rescore/G.fst";
-    string carpa_rxfilename_ = "model/rescore/G.carpa";
+    string nnet3_rxfilename_ = model_path_str + "/am/final.mdl";
+    string hclg_fst_rxfilename_ = model_path_str + "/graph/HCLG.fst";
+    string word_syms_rxfilename_ = model_path_str + "/graph/words.txt";
+    string winfo_rxfilename_ = model_path_str + "/graph/phones/word_boundary.int";
+    string std_fst_rxfilename_ = model_path_str + "/rescore/G.fst";
+    string carpa_rxfilename_ = model_path_str + "/rescore/G.carpa";
 
     trans_model_ = new kaldi::TransitionModel();
     nnet_ = new kaldi::nnet3::AmNnetSimple();
@@ -99,26 +136,48 @@ BatchRecognizer::BatchRecognizer() {
          (batched_decoder_config, *hclg_fst_, *nnet_, *trans_model_);
     cuda_pipeline_->SetSymbolTable(*word_syms_);
 
-    CudaOnlinePipelineDynamicBatcherConfig dynamic_batcher_config;
     dynamic_batcher_ = new CudaOnlinePipelineDynamicBatcher(dynamic_batcher_config,
                                                             *cuda_pipeline_);
+
+    int num_post_processing_threads = GetConfigNumber(obj, "num_post_processing_threads", 2);
+    for (int i = 0; i < std::max(num_post_processing_threads, 1); i++) {
+        PostProcessor *processor = new PostProcessor();
+        if (graph_lm_fst_) {
+            fst::CacheOptions cache_opts(true, -1);
+            fst::ArcMapFstOptions mapfst_opts(cache_opts);
+            fst::StdToLatticeMapper<BaseFloat> mapper;
+            processor->lm_to_subtract = new fst::ArcMapFst<fst::StdArc, LatticeArc, fst::StdToLatticeMapper<BaseFloat> >(*graph_lm_fst_, mapper, mapfst_opts);
+            processor->carpa_to_add = new ConstArpaLmDeterministicFst(const_arpa_);
+        }
+        processor->thread = std::thread(&BatchRecognizer::RunPostProcessor, this, processor);
+        post_processors_.push_back(processor);
+    }
 }
 
 BatchRecognizer::~BatchRecognizer() {
 
+    // Stop the pipeline first, it calls back with lattices
+    delete dynamic_batcher_;
+    delete cuda_pipeline_;
+
+    for (PostProcessor *processor : post_processors_) {
+        {
+            std::lock_guard<std::mutex> lock(processor->mutex);
+            processor->stop = true;
+        }
+        processor->cond.notify_one();
+        processor->thread.join();
+        delete processor->lm_to_subtract;
+        delete processor->carpa_to_add;
+        delete processor;
+    }
+
     delete trans_model_;
     delete nnet_;
     delete word_syms_;
     delete winfo_;
     delete hclg_fst_;
     delete graph_lm_fst_;
-
-    delete lm_to_subtract_;
-    delete carpa_to_add_;
-    delete carpa_to_add_scale_;
-
-    delete cuda_pipeline_;
-    delete dynamic_batcher_;
 }
 
 void BatchRecognizer::FinishStream(uint64_t id)
@@ -126,10 +185,86 @@ void BatchRecognizer::FinishStream(uint64_t id)
     Vector<BaseFloat> wave;
     SubVector<BaseFloat> chunk(wave.Data(), 0);
     dynamic_batcher_->Push(id, false, true, chunk);
+
+    std::lock_guard<std::mutex> lock(streams_mutex_);
     streams_.erase(id);
 }
 
 
+void BatchRecognizer::QueueLattice(uint64_t id, const CompactLattice &clat, BaseFloat offset)
+{
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        pending_lattices_++;
+    }
+
+    PostProcessor *processor = post_processors_[id % post_processors_.size()];
+    {
+        std::lock_guard<std::mutex> lock(processor->mutex);
+        processor->tasks.push_back(LatticeTask{id, clat, offset});
+    }
+    processor->cond.notify_one();
+}
+
+void BatchRecognizer::RunPostProcessor(PostProcessor *processor)
+{
+    while (true) {
+        LatticeTask task;
+        {
+            std::unique_lock<std::mutex> lock(processor->mutex);
+            processor->cond.wait(lock, [processor]() { return processor->stop || !processor->tasks.empty(); });
+            if (processor->tasks.empty()) {
+                return;
+            }
+            task = std::move(processor->tasks.front());
+            processor->tasks.pop_front();
+        }
+
+        try {
+            CompactLattice rlat;
+            if (RescoreLattice(processor, task.clat, &rlat)) {
+                PushLattice(task.id, rlat, task.offset);
+            } else {
+                PushLattice(task.id, task.clat, task.offset);
+            }
+        } catch (const std::exception &e) {
+            KALDI_WARN << "Failed to process lattice of stream " << task.id << ": " << e.what();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            pending_lattices_--;
+        }
+        pending_cond_.notify_all();
+    }
+}
+
+// Replaces the graph LM score with the CARPA score, returns false if
+// there is no rescoring model or the result is empty
+bool BatchRecognizer::RescoreLattice(PostProcessor *processor, const CompactLattice &clat, CompactLattice *rlat)
+{
+    if (!processor->lm_to_subtract || !processor->carpa_to_add) {
+        return false;
+    }
+
+    Lattice lat, composed_lat;
+    CompactLattice slat;
+
+    // Delete old score
+    ConvertLattice(clat, &lat);
+    fst::ScaleLattice(fst::GraphLatticeScale(-1.0), &lat);
+    fst::Compose(lat, *processor->lm_to_subtract, &composed_lat);
+    fst::Invert(&composed_lat);
+    DeterminizeLattice(composed_lat, &slat);
+    fst::ScaleLattice(fst::GraphLatticeScale(-1.0), &slat);
+
+    // Add CARPA score
+    TopSortCompactLatticeIfNeeded(&slat);
+    ComposeCompactLatticeDeterministic(slat, processor->carpa_to_add, rlat);
+
+    return rlat->Start() == 0;
+}
+
 void BatchRecognizer::PushLattice(uint64_t id, CompactLattice &clat, BaseFloat offset)
 {
     fst::ScaleLattice(fst::GraphLatticeScale(0.9), &clat);
@@ -145,38 +280,80 @@ void BatchRecognizer::PushLattice(uint64_t id, CompactLattice &clat, BaseFloat o
 
     int size = words.size();
 
-    json::JSON obj;
-    stringstream text;
-
-    // Create JSON object
+    // Keys are written in the order JSON::dump() sorts them
+    string res;
+    string text;
+    json::JSONWriter writer(res);
+    writer.BeginObject();
+    if (size > 0) {
+        writer.Key("result");
+        writer.BeginArray();
+    }
     for (int i = 0; i < size; i++) {
-        json::JSON word;
+        const string &word = word_syms_->Find(words[i]);
 
-        word["word"] = word_syms_->Find(words[i]);
-        word["start"] = round(times[i].first) * 0.03 + offset;
-        word["end"] = round(times[i].second) * 0.03 + offset;
-        word["conf"] = conf[i];
-        obj["result"].append(word);
+        writer.BeginObject();
+        writer.Member("conf", conf[i]);
+        writer.Member("end", round(times[i].second) * 0.03 + offset);
+        writer.Member("start", round(times[i].first) * 0.03 + offset);
+        writer.Member("word", word);
+        writer.EndObject();
 
         if (i) {
-            text << " ";
+            text += " ";
         }
-        text << word_syms_->Find(words[i]);
+        text += word;
+    }
+    if (size > 0) {
+        writer.EndArray();
+    }
+    writer.Member("text", text);
+    writer.EndObject();
+
+    ResultShard &shard = result_shards_[id % kNumResultShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    std::deque<std::string> &results = shard.results[id];
+    results.push_back(std::move(res));
+    // Announced once until the client pops the results
+    if (results.size() == 1) {
+        MarkReady(id);
     }
-    obj["text"] = text.str();
+}
 
-//    KALDI_LOG << "Result " << id << " " << obj.dump();
+// Called with the shard of the stream locked, so the ready queue follows
+// the result deques
+void BatchRecognizer::MarkReady(uint64_t id)
+{
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        if (!ready_set_.insert(id).second) {
+            return;
+        }
+        ready_ids_.push_back(id);
+    }
+    ready_cond_.notify_one();
+}
 
-    results_[id].push(obj.dump());
+// The id stays in the queue and is skipped by NextResult, each queued id
+// is dropped once, either there or here when no stream is ready
+void BatchRecognizer::UnmarkReady(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    if (ready_set_.erase(id) && ready_set_.empty()) {
+        ready_ids_.clear();
+    }
 }
 
 void BatchRecognizer::AcceptWaveform(uint64_t id, const char *data, int len)
 {
     bool first = false;
 
-    if (streams_.find(id) == streams_.end()) {
-        first = true;
-        streams_.insert(id);
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex_);
+        first = streams_.insert(id).second;
+    }
+
+    if (first) {
 
         // Define the callback for results.
 #if 0
@@ -206,39 +383,74 @@ void BatchRecognizer::AcceptWaveform(uint64_t id, const char *data, int len)
               }
               CompactLattice *clat = params.results[0].GetLatticeResult();
               BaseFloat offset = params.results[0].GetTimeOffsetSeconds();
-              PushLattice(id, *clat, offset);
+              QueueLattice(id, *clat, offset);
           },
           CudaPipelineResult::RESULT_TYPE_LATTICE);
     }
 
     Vector<BaseFloat> wave;
     wave.Resize(len / 2, kUndefined);
-    for (int i = 0; i < len / 2; i++)
-        wave(i) = *(((short *)data) + i);
+    ConvertSamples((const short *)data, wave.Data(), len / 2);
     SubVector<BaseFloat> chunk(wave.Data(), wave.Dim());
 
     dynamic_batcher_->Push(id, first, false, chunk);
 }
 
+// The returned string stays valid until Pop, deque doesn't move
+// its elements when new results are appended
 const char* BatchRecognizer::FrontResult(uint64_t id)
 {
-    if (results_[id].empty()) {
+    ResultShard &shard = result_shards_[id % kNumResultShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.results.find(id);
+    if (it == shard.results.end() || it->second.empty()) {
         return "";
     }
-    return results_[id].front().c_str();
+    return it->second.front().c_str();
 }
 
 void BatchRecognizer::Pop(uint64_t id)
 {
-    if (results_[id].empty()) {
+    ResultShard &shard = result_shards_[id % kNumResultShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.results.find(id);
+    if (it == shard.results.end() || it->second.empty()) {
         return;
     }
-    results_[id].pop();
+    it->second.pop_front();
+    if (it->second.empty()) {
+        shard.results.erase(it);
+        UnmarkReady(id);
+    } else {
+        // Announce the remaining results again if NextResult took the id
+        MarkReady(id);
+    }
+}
+
+bool BatchRecognizer::NextResult(uint64_t *id, int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(ready_mutex_);
+    if (!ready_cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                              [this]() { return !ready_set_.empty(); })) {
+        return false;
+    }
+    // Skip the ids of streams popped empty since they were queued
+    while (true) {
+        *id = ready_ids_.front();
+        ready_ids_.pop_front();
+        if (ready_set_.erase(*id)) {
+            return true;
+        }
+    }
 }
 
 void BatchRecognizer::WaitForCompletion()
 {
     dynamic_batcher_->WaitForCompletion();
+    cuda_pipeline_->WaitForLatticeCallbacks();
+
+    std::unique_lock<std::mutex> lock(pending_mutex_);
+    pending_cond_.wait(lock, [this]() { return pending_lattices_ == 0; });
 }
 
 int BatchRecognizer::GetPendingChunks(uint64_t id)
@@ -35,12 +35,20 @@
 
 #include "model.h"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
 using namespace kaldi;
 using namespace kaldi::cuda_decoder;
 
 class BatchRecognizer {
     public:
         BatchRecognizer();
+        BatchRecognizer(const char *model_path, const char *config);
         ~BatchRecognizer();
 
         void FinishStream(uint64_t id);
@@ -49,9 +57,13 @@ class BatchRecognizer {
         void Pop(uint64_t id);
         void WaitForCompletion();
         int GetPendingChunks(uint64_t id);
+        // Waits for the next result of any stream, returns false on timeout
+        bool NextResult(uint64_t *id, int timeout_ms);
 
     private:
         void PushLattice(uint64_t id, CompactLattice &clat, BaseFloat offset);
+        void MarkReady(uint64_t id);
+        void UnmarkReady(uint64_t id);
 
         kaldi::TransitionModel *trans_model_ = nullptr;
         kaldi::nnet3::AmNnetSimple *nnet_ = nullptr;
@@ -67,13 +79,53 @@ class BatchRecognizer {
         CudaOnlinePipelineDynamicBatcher *dynamic_batcher_ = nullptr;
 
 
-        std::set<int> streams_;
-        std::map<int, std::queue<std::string> > results_;
-
-        // Rescoring
-        fst::ArcMapFst<fst::StdArc, LatticeArc, fst::StdToLatticeMapper<BaseFloat> > *lm_to_subtract_ = nullptr;
-        kaldi::ConstArpaLmDeterministicFst *carpa_to_add_ = nullptr;
-        fst::ScaleDeterministicOnDemandFst *carpa_to_add_scale_ = nullptr;
+        // Results are written from the pipeline threads and read by clients,
+        // streams are spread over shards to keep the locks short
+        static const int kNumResultShards = 64;
+        struct ResultShard {
+            std::mutex mutex;
+            std::unordered_map<uint64_t, std::deque<std::string> > results;
+        };
+        ResultShard result_shards_[kNumResultShards];
+
+        // Streams with results not yet announced by NextResult, in the
+        // order their results arrived. The set holds the ready streams,
+        // the queue may also hold stale ids of streams emptied by Pop.
+        std::mutex ready_mutex_;
+        std::condition_variable ready_cond_;
+        std::deque<uint64_t> ready_ids_;
+        std::unordered_set<uint64_t> ready_set_;
+
+        std::mutex streams_mutex_;
+        std::unordered_set<uint64_t> streams_;
+
+        // Lattices are rescored and converted to results by the post-processing
+        // threads. Streams are assigned to threads by id to keep the order
+        // of their results.
+        struct LatticeTask {
+            uint64_t id;
+            CompactLattice clat;
+            BaseFloat offset;
+        };
+        struct PostProcessor {
+            std::thread thread;
+            std::mutex mutex;
+            std::condition_variable cond;
+            std::deque<LatticeTask> tasks;
+            bool stop = false;
+
+            // Rescoring FSTs cache their states, every thread has its own
+            fst::ArcMapFst<fst::StdArc, LatticeArc, fst::StdToLatticeMapper<BaseFloat> > *lm_to_subtract = nullptr;
+            kaldi::ConstArpaLmDeterministicFst *carpa_to_add = nullptr;
+        };
+        void QueueLattice(uint64_t id, const CompactLattice &clat, BaseFloat offset);
+        void RunPostProcessor(PostProcessor *processor);
+        bool RescoreLattice(PostProcessor *processor, const CompactLattice &clat, CompactLattice *rlat);
+
+        std::vector<PostProcessor *> post_processors_;
+        std::mutex pending_mutex_;
+        std::condition_variable pending_cond_;
+        int pending_lattices_ = 0;
 
         float sample_frequency_;
 };
@@ -0,0 +1,183 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fst_cache.h"
+
+#include <utility>
+
+using namespace fst;
+
+// Approximate memory used by a cached state including the hash map node
+static size_t StateBytes(const FstStateCache::State &state)
+{
+    return sizeof(FstStateCache::State) + state.arcs.capacity() * sizeof(StdArc) + 64;
+}
+
+FstStateCache::FstStateCache(Fst<Arc> *fst, size_t max_bytes) : fst_(fst)
+{
+    start_ = fst_->Start();
+    properties_ = fst_->Properties(kFstProperties, false);
+    max_shard_bytes_ = max_bytes / kNumShards;
+}
+
+FstStateCache::~FstStateCache()
+{
+    for (Shard &shard : shards_) {
+        for (auto &entry : shard.states) {
+            Release(entry.second.state);
+        }
+    }
+}
+
+const FstStateCache::State *FstStateCache::Acquire(StateId s)
+{
+    Shard &shard = shards_[s % kNumShards];
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.states.find(s);
+        if (it != shard.states.end()) {
+            // Avoid writing the shared line when the flag is already set
+            if (!it->second.referenced.load(std::memory_order_relaxed))
+                it->second.referenced.store(true, std::memory_order_relaxed);
+            it->second.state->refs.fetch_add(1, std::memory_order_relaxed);
+            return it->second.state;
+        }
+    }
+
+    State *state = ExpandState(s);
+
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto res = shard.states.emplace(s, state);
+    if (!res.second) {
+        // Another thread has expanded the same state meanwhile
+        delete state;
+        res.first->second.state->refs.fetch_add(1, std::memory_order_relaxed);
+        return res.first->second.state;
+    }
+    shard.bytes += StateBytes(*state);
+    // The reference of the caller, the cache keeps the initial one
+    state->refs.fetch_add(1, std::memory_order_relaxed);
+    if (shard.bytes > max_shard_bytes_)
+        Evict(shard);
+    return state;
+}
+
+void FstStateCache::Release(const State *state)
+{
+    if (state->refs.fetch_sub(1, std::memory_order_release) == 1) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        delete state;
+    }
+}
+
+FstStateCache::State *FstStateCache::ExpandState(StateId s)
+{
+    State *state = new State();
+
+    std::lock_guard<std::mutex> lock(fst_mutex_);
+    state->final = fst_->Final(s);
+    state->arcs.reserve(fst_->NumArcs(s));
+    for (ArcIterator<Fst<Arc> > aiter(*fst_, s); !aiter.Done(); aiter.Next()) {
+        state->arcs.push_back(aiter.Value());
+    }
+    state->num_input_epsilons = fst_->NumInputEpsilons(s);
+    state->num_output_epsilons = fst_->NumOutputEpsilons(s);
+    return state;
+}
+
+// Second-chance replacement: states read since the previous sweep survive
+// with the flag cleared, the rest are dropped. Recognizers still holding
+// the dropped states keep them alive through their references.
+void FstStateCache::Evict(Shard &shard)
+{
+    for (auto it = shard.states.begin(); it != shard.states.end(); ) {
+        if (it->second.referenced.load(std::memory_order_relaxed)) {
+            it->second.referenced.store(false, std::memory_order_relaxed);
+            ++it;
+        } else {
+            shard.bytes -= StateBytes(*it->second.state);
+            Release(it->second.state);
+            it = shard.states.erase(it);
+        }
+    }
+}
+
+CachedFst::CachedFst(std::shared_ptr<FstStateCache> cache) : cache_(cache), slots_(kNumSlots)
+{
+}
+
+CachedFst::~CachedFst()
+{
+    for (Slot &slot : slots_) {
+        if (slot.state)
+            FstStateCache::Release(slot.state);
+    }
+    for (Slot &slot : overflow_) {
+        FstStateCache::Release(slot.state);
+    }
+}
+
+const std::string &CachedFst::Type() const
+{
+    static const std::string type = "cached";
+    return type;
+}
+
+void CachedFst::InitStateIterator(StateIteratorData<Arc> *data) const
+{
+    KALDI_ERR << "State iteration is not supported on the shared graph cache";
+}
+
+CachedFst::Slot *CachedFst::GetSlot(StateId s) const
+{
+    Slot *slot = &slots_[s & (kNumSlots - 1)];
+    if (slot->id == s) {
+        return slot;
+    }
+
+    if (slot->count > 0) {
+        // An arc iterator still uses the slot
+        for (auto it = overflow_.begin(); it != overflow_.end(); ) {
+            if (it->id == s) {
+                return &*it;
+            }
+            if (it->count == 0) {
+                FstStateCache::Release(it->state);
+                it = overflow_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        overflow_.emplace_back();
+        slot = &overflow_.back();
+    } else if (slot->state) {
+        FstStateCache::Release(slot->state);
+    }
+
+    slot->id = s;
+    slot->state = cache_->Acquire(s);
+    return slot;
+}
+
+void CachedFst::InitArcIterator(StateId s, ArcIteratorData<Arc> *data) const
+{
+    // Same as the cached states of OpenFST, the iterator reads the arcs
+    // directly and decrements the count when it is destroyed
+    Slot *slot = GetSlot(s);
+    slot->count++;
+    data->base = nullptr;
+    data->arcs = slot->state->arcs.data();
+    data->narcs = slot->state->arcs.size();
+    data->ref_count = &slot->count;
+}
@@ -0,0 +1,145 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_FST_CACHE_H
+#define VOSK_FST_CACHE_H
+
+#include "base/kaldi-common.h"
+#include "fstext/fstext-lib.h"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// Thread-safe cache of the expanded states of a lazy FST like the lookahead
+// composition of HCLr.fst and Gr.fst. Recognizers decoding with the same
+// graph share it, so every state is expanded only once. The memory is capped,
+// states are evicted with second-chance replacement when a shard gets full.
+class FstStateCache {
+    public:
+        typedef fst::StdArc Arc;
+        typedef Arc::StateId StateId;
+        typedef Arc::Weight Weight;
+
+        // States are reference-counted, the cache holds one reference and
+        // every recognizer view one for each state it keeps
+        struct State {
+            Weight final;
+            std::vector<Arc> arcs;
+            size_t num_input_epsilons;
+            size_t num_output_epsilons;
+            mutable std::atomic<int> refs;
+
+            State(): refs(1) { }
+        };
+
+        // Takes ownership of the fst
+        FstStateCache(fst::Fst<Arc> *fst, size_t max_bytes);
+        ~FstStateCache();
+
+        StateId Start() const { return start_; }
+        uint64_t Properties() const { return properties_; }
+        const fst::SymbolTable *InputSymbols() const { return fst_->InputSymbols(); }
+        const fst::SymbolTable *OutputSymbols() const { return fst_->OutputSymbols(); }
+
+        // Returns the state with a reference taken for the caller
+        const State *Acquire(StateId s);
+        static void Release(const State *state);
+
+    private:
+        struct Entry {
+            const State *state;
+            std::atomic<bool> referenced;
+
+            Entry(const State *state): state(state), referenced(true) { }
+        };
+
+        // Expanded states are only read, lookups share the lock
+        struct Shard {
+            std::shared_mutex mutex;
+            std::unordered_map<StateId, Entry> states;
+            size_t bytes = 0;
+        };
+
+        static const int kNumShards = 64;
+
+        State *ExpandState(StateId s);
+        void Evict(Shard &shard);
+
+        // The underlying lazy FST is not thread-safe, only one
+        // thread expands states at a time.
+        std::unique_ptr<fst::Fst<Arc> > fst_;
+        std::mutex fst_mutex_;
+
+        StateId start_;
+        uint64_t properties_;
+
+        Shard shards_[kNumShards];
+        size_t max_shard_bytes_;
+};
+
+// FST view of the shared cache, every recognizer owns a copy. The view
+// keeps the recently used states in a direct-mapped table, so the decoder
+// reads them without locks or atomic operations and iterates over the
+// arcs directly like over a VectorFst. The table is only used by the
+// thread which runs the recognizer.
+class CachedFst : public fst::Fst<fst::StdArc> {
+    public:
+        typedef fst::StdArc Arc;
+        typedef Arc::StateId StateId;
+        typedef Arc::Weight Weight;
+        typedef FstStateCache::State State;
+
+        explicit CachedFst(std::shared_ptr<FstStateCache> cache);
+        ~CachedFst() override;
+
+        StateId Start() const override { return cache_->Start(); }
+        Weight Final(StateId s) const override { return GetState(s)->final; }
+        size_t NumArcs(StateId s) const override { return GetState(s)->arcs.size(); }
+        size_t NumInputEpsilons(StateId s) const override { return GetState(s)->num_input_epsilons; }
+        size_t NumOutputEpsilons(StateId s) const override { return GetState(s)->num_output_epsilons; }
+        uint64_t Properties(uint64_t mask, bool test) const override { return cache_->Properties() & mask; }
+        const std::string &Type() const override;
+        CachedFst *Copy(bool safe = false) const override { return new CachedFst(cache_); }
+        const fst::SymbolTable *InputSymbols() const override { return cache_->InputSymbols(); }
+        const fst::SymbolTable *OutputSymbols() const override { return cache_->OutputSymbols(); }
+        void InitStateIterator(fst::StateIteratorData<Arc> *data) const override;
+        void InitArcIterator(StateId s, fst::ArcIteratorData<Arc> *data) const override;
+
+    private:
+        // A state held by the view, the count is the number of arc
+        // iterators using it and is decremented by the iterators
+        struct Slot {
+            StateId id = fst::kNoStateId;
+            const State *state = nullptr;
+            int count = 0;
+        };
+
+        static const int kNumSlots = 4096;
+
+        Slot *GetSlot(StateId s) const;
+        const State *GetState(StateId s) const { return GetSlot(s)->state; }
+
+        std::shared_ptr<FstStateCache> cache_;
+        mutable std::vector<Slot> slots_;
+        // States which collide with a slot in use by an iterator, rare
+        // since the decoder iterates over one state at a time
+        mutable std::list<Slot> overflow_;
+};
+
+#endif /* VOSK_FST_CACHE_H */
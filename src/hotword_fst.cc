@@ -0,0 +1,90 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hotword_fst.h"
+
+#include <queue>
+
+HotwordFst::HotwordFst() : nodes_(1)
+{
+}
+
+void HotwordFst::AddPhrase(const std::vector<kaldi::int32> &words, float boost)
+{
+    if (words.empty())
+        return;
+
+    StateId s = 0;
+    for (kaldi::int32 word : words) {
+        auto it = nodes_[s].next.find(word);
+        if (it != nodes_[s].next.end()) {
+            s = it->second;
+        } else {
+            StateId n = nodes_.size();
+            nodes_[s].next[word] = n;
+            nodes_.emplace_back();
+            s = n;
+        }
+    }
+    nodes_[s].boost += boost;
+}
+
+void HotwordFst::Finish()
+{
+    // Breadth first, the failure target is always closer to the root
+    std::queue<StateId> queue;
+    for (const auto &child : nodes_[0].next) {
+        nodes_[child.second].fail = 0;
+        queue.push(child.second);
+    }
+    while (!queue.empty()) {
+        StateId s = queue.front();
+        queue.pop();
+        for (const auto &child : nodes_[s].next) {
+            StateId f = nodes_[s].fail;
+            while (f != 0 && nodes_[f].next.count(child.first) == 0) {
+                f = nodes_[f].fail;
+            }
+            auto it = nodes_[f].next.find(child.first);
+            StateId fail = it != nodes_[f].next.end() && it->second != child.second ? it->second : 0;
+            nodes_[child.second].fail = fail;
+            nodes_[child.second].boost += nodes_[fail].boost;
+            queue.push(child.second);
+        }
+    }
+}
+
+bool HotwordFst::GetArc(StateId s, Label ilabel, fst::StdArc *oarc)
+{
+    KALDI_ASSERT(static_cast<size_t>(s) < nodes_.size());
+
+    // Words outside the phrases go back to the root, never blocked
+    StateId next = 0;
+    while (true) {
+        auto it = nodes_[s].next.find(ilabel);
+        if (it != nodes_[s].next.end()) {
+            next = it->second;
+            break;
+        }
+        if (s == 0)
+            break;
+        s = nodes_[s].fail;
+    }
+
+    oarc->ilabel = ilabel;
+    oarc->olabel = ilabel;
+    oarc->nextstate = next;
+    oarc->weight = Weight(-nodes_[next].boost);
+    return true;
+}
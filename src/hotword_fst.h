@@ -0,0 +1,55 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_HOTWORD_FST_H
+#define VOSK_HOTWORD_FST_H
+
+#include "base/kaldi-common.h"
+#include "fstext/deterministic-fst.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Boosts word sequences when composed with a lattice, so contextual phrases
+// like names win over similar sounding alternatives without building a new
+// graph. States are nodes of a trie of the phrases with Aho-Corasick failure
+// links. A phrase gets its boost when its last word is read, partial matches
+// cost nothing and matches may overlap. Building takes time linear in the
+// total length of the phrases.
+class HotwordFst : public fst::DeterministicOnDemandFst<fst::StdArc> {
+    public:
+        HotwordFst();
+
+        // The boost is subtracted from the graph cost of the phrase
+        void AddPhrase(const std::vector<kaldi::int32> &words, float boost);
+        // Computes the failure links, call after all phrases are added
+        void Finish();
+        bool Empty() const { return nodes_.size() == 1; }
+
+        StateId Start() override { return 0; }
+        Weight Final(StateId s) override { return Weight::One(); }
+        bool GetArc(StateId s, Label ilabel, fst::StdArc *oarc) override;
+
+    private:
+        struct Node {
+            std::unordered_map<Label, StateId> next;
+            StateId fail = 0;
+            // Boosts of the phrases ending here, also the ones ending
+            // with a suffix of this node
+            float boost = 0;
+        };
+        std::vector<Node> nodes_;
+};
+
+#endif /* VOSK_HOTWORD_FST_H */
@@ -0,0 +1,162 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_JSON_WRITER_H
+#define VOSK_JSON_WRITER_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace json {
+
+// Streaming writer producing exactly the same text as JSON::dump() without
+// building the tree. The text is appended to a buffer owned by the caller,
+// so a buffer reused between results doesn't allocate once it has grown.
+//
+// JSON::dump() prints object keys sorted, the caller has to add them in
+// the same order. Keys are written as is, like the keys of JSON objects.
+class JSONWriter {
+    public:
+        explicit JSONWriter(std::string &out) : out_(out) {
+            out_.clear();
+        }
+
+        void BeginObject() {
+            BeginValue();
+            out_ += "{\n";
+            Push();
+        }
+
+        void EndObject() {
+            depth_--;
+            out_ += '\n';
+            out_.append(2 * depth_, ' ');
+            out_ += '}';
+        }
+
+        void BeginArray() {
+            BeginValue();
+            out_ += '[';
+            Push();
+        }
+
+        void EndArray() {
+            depth_--;
+            out_ += ']';
+        }
+
+        void Key(const char *key) {
+            if (!first_[depth_])
+                out_ += ",\n";
+            first_[depth_] = false;
+            out_.append(2 * depth_, ' ');
+            out_ += '"';
+            out_ += key;
+            out_ += "\" : ";
+            after_key_ = true;
+        }
+
+        void Value(const std::string &s) {
+            Value(s.data(), s.size());
+        }
+
+        void Value(const char *s) {
+            Value(s, strlen(s));
+        }
+
+        void Value(const char *s, size_t len) {
+            BeginValue();
+            out_ += '"';
+            for (size_t i = 0; i < len; i++) {
+                switch (s[i]) {
+                    case '\"': out_ += "\\\""; break;
+                    case '\\': out_ += "\\\\"; break;
+                    case '\b': out_ += "\\b";  break;
+                    case '\f': out_ += "\\f";  break;
+                    case '\n': out_ += "\\n";  break;
+                    case '\r': out_ += "\\r";  break;
+                    case '\t': out_ += "\\t";  break;
+                    default  : out_ += s[i]; break;
+                }
+            }
+            out_ += '"';
+        }
+
+        // Same formatting as std::to_string
+        void Value(double d) {
+            char buf[512];
+            int len = snprintf(buf, sizeof(buf), "%f", d);
+            BeginValue();
+            out_.append(buf, len);
+        }
+
+        void Value(float f) {
+            Value((double)f);
+        }
+
+        void Value(long l) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%ld", l);
+            BeginValue();
+            out_.append(buf, len);
+        }
+
+        void Value(int i) {
+            Value((long)i);
+        }
+
+        void Value(bool b) {
+            BeginValue();
+            out_ += b ? "true" : "false";
+        }
+
+        // Shortcuts for object members
+        template <typename T>
+        void Member(const char *key, const T &value) {
+            Key(key);
+            Value(value);
+        }
+
+    private:
+        static const int kMaxDepth = 32;
+
+        // Array elements are separated by commas, object members
+        // get theirs from Key()
+        void BeginValue() {
+            if (after_key_) {
+                after_key_ = false;
+                return;
+            }
+            if (depth_ > 0) {
+                if (!first_[depth_])
+                    out_ += ", ";
+                first_[depth_] = false;
+            }
+        }
+
+        void Push() {
+            depth_++;
+            first_[depth_] = true;
+        }
+
+        std::string &out_;
+        int depth_ = 0;
+        bool after_key_ = false;
+        bool first_[kMaxDepth + 1];
+};
+
+} // namespace json
+
+#endif /* VOSK_JSON_WRITER_H */
@@ -24,106 +24,145 @@
 
 using namespace kaldi;
 
+int32 LanguageModelEstimator::PairTable::Find(int32 a, int32 b) const {
+  if (keys_.empty())
+    return -1;
+  uint64_t key = Key(a, b);
+  size_t mask = keys_.size() - 1;
+  for (size_t i = Slot(key); ; i = (i + 1) & mask) {
+    if (keys_[i] == key)
+      return values_[i];
+    if (keys_[i] == kEmpty)
+      return -1;
+  }
+}
+
+int32 LanguageModelEstimator::PairTable::FindOrInsert(int32 a, int32 b,
+                                                      int32 value) {
+  KALDI_ASSERT(a >= 0 && b >= 0);
+  if (2 * (size_ + 1) > keys_.size())
+    Grow();
+  uint64_t key = Key(a, b);
+  size_t mask = keys_.size() - 1;
+  for (size_t i = Slot(key); ; i = (i + 1) & mask) {
+    if (keys_[i] == key)
+      return values_[i];
+    if (keys_[i] == kEmpty) {
+      keys_[i] = key;
+      values_[i] = value;
+      size_++;
+      return value;
+    }
+  }
+}
+
+void LanguageModelEstimator::PairTable::Grow() {
+  std::vector<uint64_t> keys(std::max<size_t>(64, 2 * keys_.size()), kEmpty);
+  std::vector<int32> values(keys.size());
+  keys.swap(keys_);
+  values.swap(values_);
+  size_t mask = keys_.size() - 1;
+  for (size_t j = 0; j < keys.size(); j++) {
+    if (keys[j] == kEmpty)
+      continue;
+    size_t i = Slot(keys[j]);
+    while (keys_[i] != kEmpty)
+      i = (i + 1) & mask;
+    keys_[i] = keys[j];
+    values_[i] = values[j];
+  }
+}
+
 void LanguageModelEstimator::AddCounts(const std::vector<int32> &sentence) {
   KALDI_ASSERT(opts_.ngram_order >= 2 && "--ngram-order must be >= 2");
-  int32 order = opts_.ngram_order;
   // 0 is used for left-context at the beginning of the file.. treat it as BOS.
-  std::vector<int32> history(0);
+  int32 lm_state = 0;
   std::vector<int32>::const_iterator iter = sentence.begin(),
       end = sentence.end();
   for (; iter != end; ++iter) {
-    KALDI_ASSERT(*iter != 0);
-    IncrementCount(history, *iter);
-    history.push_back(*iter);
-    if (history.size() >= order)
-      history.erase(history.begin());
+    KALDI_ASSERT(*iter > 0);
+    AddCount(lm_state, *iter, 1);
+    lm_state = FindOrCreateNextLmState(lm_state, *iter);
   }
   // Probability of end of sentence.  This will end up getting ignored later, but
   // it still makes a difference for probability-normalization reasons.
-  IncrementCount(history, 0);
+  AddCount(lm_state, 0, 1);
 }
 
-void LanguageModelEstimator::IncrementCount(const std::vector<int32> &history,
-                                            int32 next_phone) {
-  int32 lm_state_index = FindOrCreateLmStateIndexForHistory(history);
-  if (lm_states_[lm_state_index].tot_count == 0) {
-    num_active_lm_states_++;
+void LanguageModelEstimator::AddCount(int32 lm_state, int32 phone,
+                                      int32 count) {
+  int32 index = ngram_table_.FindOrInsert(lm_state, phone,
+                                          ngram_counts_.size());
+  if (index == static_cast<int32>(ngram_counts_.size())) {
+    NgramCount ngram = { lm_state, phone, 0 };
+    ngram_counts_.push_back(ngram);
   }
-  lm_states_[lm_state_index].AddCount(next_phone, 1);
+  ngram_counts_[index].count += count;
+  if (lm_states_[lm_state].tot_count == 0)
+    num_active_lm_states_++;
+  lm_states_[lm_state].tot_count += count;
 }
 
 void LanguageModelEstimator::SetParentCounts() {
-  int32 num_lm_states = lm_states_.size();
-  for (int32 l = 0; l < num_lm_states; l++) {
-    int32 l_iter = lm_states_[l].backoff_lmstate_index;
+  // Only the counts seen in the data are passed down, the counts the
+  // backoff states receive here are not passed again.
+  std::vector<NgramCount> data_counts(ngram_counts_);
+  for (const NgramCount &ngram : data_counts) {
+    int32 l_iter = lm_states_[ngram.lm_state].backoff_lmstate_index;
     while (l_iter != -1) {
-      lm_states_[l_iter].Add(lm_states_[l]);
+      AddCount(l_iter, ngram.phone, ngram.count);
       l_iter = lm_states_[l_iter].backoff_lmstate_index;
     }
   }
 }
 
-int32 LanguageModelEstimator::FindLmStateIndexForHistory(
-    const std::vector<int32> &hist) const {
-  MapType::const_iterator iter = hist_to_lmstate_index_.find(hist);
-  if (iter == hist_to_lmstate_index_.end())
-    return -1;
-  else
-    return iter->second;
+int32 LanguageModelEstimator::FindOrCreateNextLmState(int32 lm_state,
+                                                      int32 word) {
+  const LmState &state = lm_states_[lm_state];
+  if (state.order + 1 < opts_.ngram_order)
+    return FindOrCreateLmState(lm_state, word);
+  // drop the oldest word, that is the backoff state.
+  return FindOrCreateLmState(state.backoff_lmstate_index, word);
 }
 
-int32 LanguageModelEstimator::FindNonzeroLmStateIndexForHistory(
-    std::vector<int32> hist) const {
-  while (1) {
-    int32 l = FindLmStateIndexForHistory(hist);
-    if (l == -1 || lm_states_[l].tot_count == 0) {
-      // no such state or state has zero count.
-      if (hist.empty())
-        KALDI_ERR << "Error looking up LM state index for history "
-                  << "(likely code bug)";
-      hist.erase(hist.begin());  // back off.
-    } else {
-      return l;
-    }
-  }
-}
-
-int32 LanguageModelEstimator::FindOrCreateLmStateIndexForHistory(
-    const std::vector<int32> &hist) {
-  MapType::const_iterator iter = hist_to_lmstate_index_.find(hist);
-  if (iter != hist_to_lmstate_index_.end())
-    return iter->second;
-  int32 ans = lm_states_.size();  // index of next element
-  // next statement relies on default construct of LmState.
-  lm_states_.resize(lm_states_.size() + 1);
-  lm_states_.back().history = hist;
-  hist_to_lmstate_index_[hist] = ans;
-
-  // make sure backoff_lmstate_index is set
-  if (hist.size() > 0) {
-    std::vector<int32> backoff_hist(hist.begin() + 1,
-                                    hist.end());
-    int32 backoff_lm_state = FindOrCreateLmStateIndexForHistory(backoff_hist);
-    lm_states_[ans].backoff_lmstate_index = backoff_lm_state;
-  }
+int32 LanguageModelEstimator::FindOrCreateLmState(int32 prefix, int32 word) {
+  int32 ans = history_table_.FindOrInsert(prefix, word, lm_states_.size());
+  if (ans != static_cast<int32>(lm_states_.size()))
+    return ans;
+
+  lm_states_.push_back(LmState());
+  lm_states_[ans].prefix = prefix;
+  lm_states_[ans].word = word;
+  lm_states_[ans].order = lm_states_[prefix].order + 1;
+
+  // make sure backoff_lmstate_index is set, the backoff of (w1 ... wk) is
+  // (w2 ... wk), the successor of the backoff of (w1 ... wk-1).
+  int32 backoff_lm_state = 0;
+  if (prefix != 0)
+    backoff_lm_state = FindOrCreateLmState(
+        lm_states_[prefix].backoff_lmstate_index, word);
+  lm_states_[ans].backoff_lmstate_index = backoff_lm_state;
   return ans;
 }
 
-void LanguageModelEstimator::LmState::AddCount(int32 phone, int32 count) {
-  std::map<int32, int32>::iterator iter = phone_to_count.find(phone);
-  if (iter == phone_to_count.end())
-    phone_to_count[phone] = count;
-  else
-    iter->second += count;
-  tot_count += count;
-}
-
-void LanguageModelEstimator::LmState::Add(const LmState &other) {
-  KALDI_ASSERT(&other != this);
-  std::map<int32, int32>::const_iterator iter = other.phone_to_count.begin(),
-      end = other.phone_to_count.end();
-  for (; iter != end; ++iter)
-    AddCount(iter->first, iter->second);
+int32 LanguageModelEstimator::FindNonzeroNextLmState(int32 lm_state,
+                                                      int32 word) const {
+  // the history of 'lm_state' followed by 'word' is looked up as the
+  // successor of 'prefix', backing off drops the oldest word of the prefix.
+  int32 prefix = lm_state;
+  if (lm_states_[prefix].order + 1 >= opts_.ngram_order)
+    prefix = lm_states_[prefix].backoff_lmstate_index;
+  while (prefix != -1) {
+    int32 l = history_table_.Find(prefix, word);
+    if (l != -1 && lm_states_[l].tot_count != 0)
+      return l;
+    prefix = lm_states_[prefix].backoff_lmstate_index;
+  }
+  // the empty history.
+  if (lm_states_[0].tot_count == 0)
+    KALDI_ERR << "Error looking up LM state index for history "
+              << "(likely code bug)";
+  return 0;
 }
 
 int32 LanguageModelEstimator::AssignFstStates() {
@@ -147,57 +186,54 @@ void LanguageModelEstimator::Estimate(fst::StdVectorFst *fst) {
   OutputToFst(num_fst_states, fst);
 }
 
-int32 LanguageModelEstimator::FindInitialFstState() const {
-  std::vector<int32> history(0);
-  int32 l = FindNonzeroLmStateIndexForHistory(history);
-  KALDI_ASSERT(l != -1 && lm_states_[l].fst_state != -1);
-  return lm_states_[l].fst_state;
-}
-
 void LanguageModelEstimator::OutputToFst(
     int32 num_states,
     fst::StdVectorFst *fst) const {
   KALDI_ASSERT(num_states == num_active_lm_states_);
   fst->DeleteStates();
+  fst->ReserveStates(num_states);
   for (int32 i = 0; i < num_states; i++)
     fst->AddState();
-  fst->SetStart(FindInitialFstState());
-
-  int64 tot_count = 0;
-  double tot_logprob = 0.0;
+  // the empty history has a count whenever a sentence was added.
+  KALDI_ASSERT(lm_states_[0].fst_state != -1);
+  fst->SetStart(lm_states_[0].fst_state);
+
+  // Arcs of every state are added at once: the n-grams plus the backoff arc.
+  std::vector<int32> num_arcs(num_states, 0);
+  for (const NgramCount &ngram : ngram_counts_) {
+    if (ngram.phone != 0)
+      num_arcs[lm_states_[ngram.lm_state].fst_state]++;
+  }
+  for (const LmState &lm_state : lm_states_) {
+    if (lm_state.fst_state != -1)
+      fst->ReserveArcs(lm_state.fst_state,
+                       num_arcs[lm_state.fst_state] +
+                       (lm_state.backoff_lmstate_index >= 0 ? 1 : 0));
+  }
 
-  int32 num_lm_states = lm_states_.size();
-  // note: not all lm-states end up being 'active'.
-  for (int32 l = 0; l < num_lm_states; l++) {
-    const LmState &lm_state = lm_states_[l];
-    if (lm_state.fst_state == -1) {
-      continue;
+  // all n-gram counts belong to active states, so the FST is written
+  // in a single pass over them.
+  for (const NgramCount &ngram : ngram_counts_) {
+    const LmState &lm_state = lm_states_[ngram.lm_state];
+    KALDI_ASSERT(lm_state.fst_state != -1);
+    BaseFloat logprob = log(ngram.count * opts_.discount / lm_state.tot_count);
+    if (ngram.phone == 0) {  // Go to final state
+      fst->SetFinal(lm_state.fst_state, fst::TropicalWeight(-logprob));
+    } else {  // It becomes a transition.
+      int32 dest_lm_state = FindNonzeroNextLmState(ngram.lm_state, ngram.phone),
+          dest_fst_state = lm_states_[dest_lm_state].fst_state;
+      KALDI_ASSERT(dest_fst_state != -1);
+      fst->AddArc(lm_state.fst_state,
+                  fst::StdArc(ngram.phone, ngram.phone,
+                              fst::TropicalWeight(-logprob), dest_fst_state));
     }
-    int32 state_count = lm_state.tot_count;
-    KALDI_ASSERT(state_count != 0);
-    std::map<int32, int32>::const_iterator
-        iter = lm_state.phone_to_count.begin(),
-        end = lm_state.phone_to_count.end();
-    for (; iter != end; ++iter) {
-      int32 phone = iter->first, count = iter->second;
-      BaseFloat logprob = log(count * opts_.discount / state_count);
-      tot_count += count;
-      tot_logprob += logprob * count;
-      if (phone == 0) {  // Go to final state
-        fst->SetFinal(lm_state.fst_state, fst::TropicalWeight(-logprob));
-      } else {  // It becomes a transition.
-        std::vector<int32> next_history(lm_state.history);
-        next_history.push_back(phone);
-        int32 dest_lm_state = FindNonzeroLmStateIndexForHistory(next_history),
-            dest_fst_state = lm_states_[dest_lm_state].fst_state;
-        KALDI_ASSERT(dest_fst_state != -1);
-        fst->AddArc(lm_state.fst_state,
-                    fst::StdArc(phone, phone, fst::TropicalWeight(-logprob),
-                                dest_fst_state));
-      }
-    }
-    if (lm_state.backoff_lmstate_index >= 0) {
-      fst->AddArc(lm_state.fst_state, fst::StdArc(0, 0, fst::TropicalWeight(-log(1 - opts_.discount)), lm_states_[lm_state.backoff_lmstate_index].fst_state));
+  }
+  BaseFloat backoff_cost = -log(1 - opts_.discount);
+  for (const LmState &lm_state : lm_states_) {
+    if (lm_state.fst_state != -1 && lm_state.backoff_lmstate_index >= 0) {
+      fst->AddArc(lm_state.fst_state,
+                  fst::StdArc(0, 0, fst::TropicalWeight(backoff_cost),
+                              lm_states_[lm_state.backoff_lmstate_index].fst_state));
     }
   }
   fst::Connect(fst);
@@ -19,8 +19,8 @@
 #ifndef VOSK_LANGUAGE_MODEL_H
 #define VOSK_LANGUAGE_MODEL_H
 
+#include <cstdint>
 #include <vector>
-#include <map>
 
 #include "base/kaldi-common.h"
 #include "util/common-utils.h"
@@ -47,11 +47,19 @@ struct LanguageModelOptions {
   }
 };
 
+// Histories and counts are kept in flat open-addressing tables keyed by
+// pairs of int32 packed into 64 bits. A history is a state of a trie: the
+// key of history (w1 ... wk) is the state of (w1 ... wk-1) and the word wk,
+// so looking up the successor of a state is a single probe and no history
+// vectors are copied. Grammars with many thousands of phrases estimate in
+// milliseconds.
 class LanguageModelEstimator {
  public:
   LanguageModelEstimator(LanguageModelOptions &opts): opts_(opts),
                                                       num_active_lm_states_(0) {
     KALDI_ASSERT(opts.ngram_order >= 1);
+    // The empty history
+    lm_states_.push_back(LmState());
   }
 
   // Adds counts for this sentence.  Basically does: for each n-gram in the
@@ -64,12 +72,43 @@ class LanguageModelEstimator {
   void Estimate(fst::StdVectorFst *fst);
 
  protected:
+  // Map from a pair of non-negative int32 to int32, entries are never
+  // removed.  Linear probing, the table is kept at most half full.
+  class PairTable {
+   public:
+    PairTable(): size_(0) { }
+
+    // Returns -1 if the pair is missing
+    int32 Find(int32 a, int32 b) const;
+
+    // Returns the value of the pair, inserting 'value' if it is new
+    int32 FindOrInsert(int32 a, int32 b, int32 value);
+
+   private:
+    static const uint64_t kEmpty = ~static_cast<uint64_t>(0);
+
+    static uint64_t Key(int32 a, int32 b) {
+      return (static_cast<uint64_t>(static_cast<uint32_t>(a)) << 32) |
+          static_cast<uint32_t>(b);
+    }
+    size_t Slot(uint64_t key) const {
+      return (key * 0x9E3779B97F4A7C15ULL) >> 32 & (keys_.size() - 1);
+    }
+    void Grow();
+
+    std::vector<uint64_t> keys_;
+    std::vector<int32> values_;
+    size_t size_;
+  };
+
   struct LmState {
-    // the phone history associated with this state (length can vary).
-    std::vector<int32> history;
+    // LM-state index of the history without its last word, and the last
+    // word, -1 for the empty history.
+    int32 prefix;
+    int32 word;
 
-    // maps from
-    std::map<int32, int32> phone_to_count;
+    // length of the history.
+    int32 order;
 
     // total count of this state.  As we back off states to lower-order states
     // (and note that this is a hard backoff where we completely remove un-needed
@@ -84,61 +123,55 @@ class LanguageModelEstimator {
     // If not set, it's -1.
     int32 fst_state;
 
-    void AddCount(int32 phone, int32 count);
-
-    // Add the contents of another LmState.
-    void Add(const LmState &other);
-
-    LmState(): tot_count(0), backoff_lmstate_index(-1),
-               fst_state(-1) { }
-    LmState(const LmState &other):
-        history(other.history), phone_to_count(other.phone_to_count),
-        tot_count(other.tot_count),
-        backoff_lmstate_index(other.backoff_lmstate_index),
-        fst_state(other.fst_state) { }
+    LmState(): prefix(-1), word(-1), order(0), tot_count(0),
+               backoff_lmstate_index(-1), fst_state(-1) { }
   };
 
-  // maps from history to int32
-  typedef unordered_map<std::vector<int32>, int32, VectorHasher<int32> > MapType;
+  // count of 'phone' after the history of 'lm_state'.
+  struct NgramCount {
+    int32 lm_state;
+    int32 phone;
+    int32 count;
+  };
 
   LanguageModelOptions opts_;
 
-  MapType hist_to_lmstate_index_;
+  // (prefix, word) -> LM-state index
+  PairTable history_table_;
   std::vector<LmState> lm_states_;  // indexed by lmstate_index, the LmStates.
 
+  // (LM-state index, phone) -> index in ngram_counts_
+  PairTable ngram_table_;
+  std::vector<NgramCount> ngram_counts_;
+
   // Keeps track of the number of lm states that have nonzero counts.
   int32 num_active_lm_states_;
 
-
-  // adds the counts for this ngram (called from AddCounts()).
-  inline void IncrementCount(const std::vector<int32> &history,
-                             int32 next_phone);
+  // adds the counts for this ngram.
+  inline void AddCount(int32 lm_state, int32 phone, int32 count);
 
   // sets up tot_count_with_parents in all the lm-states
   void SetParentCounts();
 
-  // Finds and returns an LM-state index for a history -- or -1 if it doesn't
-  // exist.  No backoff is done.
-  int32 FindLmStateIndexForHistory(const std::vector<int32> &hist) const;
+  // Returns the LM-state index of the history of 'lm_state' followed by
+  // 'word', the oldest word is dropped if the history gets longer than
+  // ngram_order - 1.  The state and its backoff states are created if
+  // they don't exist.
+  int32 FindOrCreateNextLmState(int32 lm_state, int32 word);
 
-  // Finds and returns an LM-state index for a history -- and creates one if
-  // it doesn't exist -- and also creates any backoff states needed, down
-  // to history-length no_prune_ngram_order - 1.
-  int32 FindOrCreateLmStateIndexForHistory(const std::vector<int32> &hist);
+  // Returns the LM-state index of the history of 'prefix' followed by
+  // 'word', creating it and its backoff states if they don't exist.
+  int32 FindOrCreateLmState(int32 prefix, int32 word);
 
-  // Finds and returns the most specific LM-state index for a history or
-  // backed-off versions of it, that exists and has nonzero count.  Will die if
-  // there is no such history.  [e.g. if there is no unigram backoff state,
-  // which generally speaking there won't be.]
-  int32 FindNonzeroLmStateIndexForHistory(std::vector<int32> hist) const;
+  // Finds and returns the most specific LM-state index for the history of
+  // 'lm_state' followed by 'word' or backed-off versions of it, that exists
+  // and has nonzero count.  Will die if there is no such history.
+  int32 FindNonzeroNextLmState(int32 lm_state, int32 word) const;
 
   // after all backoff has been done, assigns FST state indexes to all states
   // that exist and have nonzero count.  Returns the number of states.
   int32 AssignFstStates();
 
-  // find the FST index of the initial-state, and returns it.
-  int32 FindInitialFstState() const;
-
   // Write to an FST
   void OutputToFst(
       int32 num_fst_states,
@@ -147,4 +180,3 @@ class LanguageModelEstimator {
 };
 
 #endif
-
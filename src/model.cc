@@ -17,8 +17,15 @@
 // For details of possible model layout see doc/models.md section model-structure
 
 #include "model.h"
+#include "language_model.h"
+#include "json.h"
+#include "quantized_nnet.h"
+#include "base/timer.h"
 
 #include <sys/stat.h>
+#include <fstream>
+#include <thread>
+#include <exception>
 #include <fst/fst.h>
 #include <fst/register.h>
 #include <fst/matcher-fst.h>
@@ -103,7 +110,8 @@ static void KaldiLogHandler(const LogMessageEnvelope &env, const char *message)
 }
 #endif
 
-Model::Model(const char *model_path) : model_path_str_(model_path) {
+Model::Model(const char *model_path, const vector<string> &extra_args) :
+    model_path_str_(model_path), extra_args_(extra_args) {
 
     SetLogHandler(KaldiLogHandler);
 
@@ -127,6 +135,43 @@ Model::Model(const char *model_path) : model_path_str_(model_path) {
     ref_cnt_ = 1;
 }
 
+Model::Model(Model *am_model, const char *graph_path) :
+    model_path_str_(graph_path) {
+
+    SetLogHandler(KaldiLogHandler);
+
+    // Always share with the model that owns the acoustic model
+    if (am_model->am_model_) {
+        am_model = am_model->am_model_;
+    }
+
+    model_opts_ = am_model->model_opts_;
+    endpoint_config_ = am_model->endpoint_config_;
+    nnet3_decoding_config_ = am_model->nnet3_decoding_config_;
+    decodable_opts_ = am_model->decodable_opts_;
+    feature_info_ = am_model->feature_info_;
+    decodable_info_ = am_model->decodable_info_;
+    nnet_batcher_ = am_model->nnet_batcher_;
+    trans_model_ = am_model->trans_model_;
+    nnet_ = am_model->nnet_;
+
+    ConfigureGraph();
+
+    vector<LoadStage> stages = {
+        { "graph", [this]() { ReadGraph(); } },
+        { "rescoring model", [this]() { ReadRescoring(); } },
+        { "RNNLM", [this]() { ReadRnnlm(); } },
+    };
+    RunLoadStages(stages);
+
+    // Only taken once loading succeeded, the destructor doesn't run
+    // if the constructor throws
+    am_model_ = am_model;
+    am_model_->Ref();
+
+    ref_cnt_ = 1;
+}
+
 // Old model layout without model configuration file
 
 void Model::ConfigureV1()
@@ -148,6 +193,7 @@ void Model::ConfigureV1()
     };
 
     kaldi::ParseOptions po("");
+    model_opts_.Register(&po);
     nnet3_decoding_config_.Register(&po);
     endpoint_config_.Register(&po);
     decodable_opts_.Register(&po);
@@ -155,6 +201,9 @@ void Model::ConfigureV1()
     vector<const char*> args;
     args.push_back("vosk");
     args.insert(args.end(), extra_args, extra_args + sizeof(extra_args) / sizeof(extra_args[0]));
+    for (const string &arg : extra_args_) {
+        args.push_back(arg.c_str());
+    }
     po.Read(args.size(), args.data());
 
     nnet3_rxfilename_ = model_path_str_ + "/final.mdl";
@@ -180,11 +229,19 @@ void Model::ConfigureV1()
 void Model::ConfigureV2()
 {
     kaldi::ParseOptions po("something");
+    model_opts_.Register(&po);
     nnet3_decoding_config_.Register(&po);
     endpoint_config_.Register(&po);
     decodable_opts_.Register(&po);
     po.ReadConfigFile(model_path_str_ + "/conf/model.conf");
-
+    if (!extra_args_.empty()) {
+        vector<const char*> args;
+        args.push_back("vosk");
+        for (const string &arg : extra_args_) {
+            args.push_back(arg.c_str());
+        }
+        po.Read(args.size(), args.data());
+    }
 
     nnet3_rxfilename_ = model_path_str_ + "/am/final.mdl";
     hclg_fst_rxfilename_ = model_path_str_ + "/graph/HCLG.fst";
@@ -206,6 +263,52 @@ void Model::ConfigureV2()
     rnnlm_lm_rxfilename_ = model_path_str_ + "/rnnlm/final.raw";
 }
 
+// Graph bundle for a shared acoustic model, either a model folder of the
+// new layout without the acoustic model or a flat folder of the old one
+
+void Model::ConfigureGraph()
+{
+    struct stat buffer;
+
+    string graph_dir = model_path_str_;
+    winfo_rxfilename_ = model_path_str_ + "/word_boundary.int";
+    if (stat((model_path_str_ + "/graph").c_str(), &buffer) == 0) {
+        graph_dir = model_path_str_ + "/graph";
+        winfo_rxfilename_ = graph_dir + "/phones/word_boundary.int";
+    }
+
+    hclg_fst_rxfilename_ = graph_dir + "/HCLG.fst";
+    hcl_fst_rxfilename_ = graph_dir + "/HCLr.fst";
+    g_fst_rxfilename_ = graph_dir + "/Gr.fst";
+    disambig_rxfilename_ = graph_dir + "/disambig_tid.int";
+    word_syms_rxfilename_ = graph_dir + "/words.txt";
+    carpa_rxfilename_ = model_path_str_ + "/rescore/G.carpa";
+    std_fst_rxfilename_ = model_path_str_ + "/rescore/G.fst";
+    rnnlm_word_feats_rxfilename_ = model_path_str_ + "/rnnlm/word_feats.txt";
+    rnnlm_feat_embedding_rxfilename_ = model_path_str_ + "/rnnlm/feat_embedding.final.mat";
+    rnnlm_config_rxfilename_ = model_path_str_ + "/rnnlm/special_symbol_opts.conf";
+    rnnlm_lm_rxfilename_ = model_path_str_ + "/rnnlm/final.raw";
+}
+
+// Reads FST in map mode. Const and ngram FSTs stored with the aligned
+// layout are mapped directly from the file, so the pages are shared
+// between processes through the page cache. Other FSTs are read as usual.
+static fst::Fst<fst::StdArc> *ReadFstMapped(const string &filename)
+{
+    std::ifstream strm(filename, std::ios_base::in | std::ios_base::binary);
+    if (!strm) {
+        KALDI_ERR << "Could not open FST file " << filename;
+    }
+
+    fst::FstReadOptions ropts(filename);
+    ropts.mode = fst::FstReadOptions::MAP;
+    fst::Fst<fst::StdArc> *fst = fst::Fst<fst::StdArc>::Read(strm, ropts);
+    if (!fst) {
+        KALDI_ERR << "Could not read FST from " << filename;
+    }
+    return fst;
+}
+
 void Model::ReadDataFiles()
 {
     struct stat buffer;
@@ -215,21 +318,92 @@ void Model::ReadDataFiles()
          " lattice-beam=" << nnet3_decoding_config_.lattice_beam;
     KALDI_LOG << "Silence phones " << endpoint_config_.silence_phones;
 
+    feature_info_ = new kaldi::OnlineNnet2FeaturePipelineInfo();
+
     if (stat(mfcc_conf_rxfilename_.c_str(), &buffer) == 0) {
-        feature_info_.feature_type = "mfcc";
-        ReadConfigFromFile(mfcc_conf_rxfilename_, &feature_info_.mfcc_opts);
-        feature_info_.mfcc_opts.frame_opts.allow_downsample = true; // It is safe to downsample
+        feature_info_->feature_type = "mfcc";
+        ReadConfigFromFile(mfcc_conf_rxfilename_, &feature_info_->mfcc_opts);
+        feature_info_->mfcc_opts.frame_opts.allow_downsample = true; // It is safe to downsample
     } else if (stat(fbank_conf_rxfilename_.c_str(), &buffer) == 0) {
-        feature_info_.feature_type = "fbank";
-        ReadConfigFromFile(fbank_conf_rxfilename_, &feature_info_.fbank_opts);
-        feature_info_.fbank_opts.frame_opts.allow_downsample = true; // It is safe to downsample
+        feature_info_->feature_type = "fbank";
+        ReadConfigFromFile(fbank_conf_rxfilename_, &feature_info_->fbank_opts);
+        feature_info_->fbank_opts.frame_opts.allow_downsample = true; // It is safe to downsample
     } else {
         KALDI_ERR << "Failed to find feature config file";
     }
 
-    feature_info_.silence_weighting_config.silence_weight = 1e-3;
-    feature_info_.silence_weighting_config.silence_phones_str = endpoint_config_.silence_phones;
+    feature_info_->silence_weighting_config.silence_weight = 1e-3;
+    feature_info_->silence_weighting_config.silence_phones_str = endpoint_config_.silence_phones;
+
+    if (stat(global_cmvn_stats_rxfilename_.c_str(), &buffer) == 0) {
+        KALDI_LOG << "Reading CMVN stats from " << global_cmvn_stats_rxfilename_;
+        feature_info_->use_cmvn = true;
+        ReadKaldiObject(global_cmvn_stats_rxfilename_, &feature_info_->global_cmvn_stats);
+    }
+
+    if (stat(pitch_conf_rxfilename_.c_str(), &buffer) == 0) {
+        KALDI_LOG << "Using pitch in feature pipeline";
+        feature_info_->add_pitch = true;
+        ReadConfigFromFile(pitch_conf_rxfilename_, &feature_info_->pitch_opts);
+    }
+
+    // Heavy files don't depend on each other, each stage fills its own members
+    vector<LoadStage> stages = {
+        { "acoustic model", [this]() { ReadAcousticModel(); } },
+        { "i-vector extractor", [this]() { ReadIvectorExtractor(); } },
+        { "graph", [this]() { ReadGraph(); } },
+        { "rescoring model", [this]() { ReadRescoring(); } },
+        { "RNNLM", [this]() { ReadRnnlm(); } },
+    };
+    RunLoadStages(stages);
+}
+
+void Model::RunLoadStages(const vector<LoadStage> &stages)
+{
+    Timer total_timer;
+    int num_threads = std::max(1, std::min<int>(model_opts_.load_threads, stages.size()));
+
+    vector<std::exception_ptr> errors(stages.size());
+    std::atomic<size_t> next_stage(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next_stage++) < stages.size()) {
+            Timer timer;
+            try {
+                stages[i].second();
+            } catch (...) {
+                errors[i] = std::current_exception();
+                continue;
+            }
+            if (model_opts_.print_load_timings) {
+                KALDI_LOG << "Loaded " << stages[i].first << " in " << timer.Elapsed() << " seconds";
+            }
+        }
+    };
+
+    vector<std::thread> threads;
+    for (int i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (auto &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    if (model_opts_.print_load_timings) {
+        KALDI_LOG << "Loaded model in " << total_timer.Elapsed() << " seconds using "
+                  << num_threads << " threads";
+    }
+}
 
+void Model::ReadAcousticModel()
+{
     trans_model_ = new kaldi::TransitionModel();
     nnet_ = new kaldi::nnet3::AmNnetSimple();
     {
@@ -242,8 +416,30 @@ void Model::ReadDataFiles()
         nnet3::CollapseModel(nnet3::CollapseModelConfig(), &(nnet_->GetNnet()));
     }
 
+    if (model_opts_.quantize_acoustic_model) {
+        int32 num_quantized = QuantizeNnet(&(nnet_->GetNnet()));
+        KALDI_LOG << "Quantized " << num_quantized << " components of the acoustic model to int8, using "
+                  << QuantizedKernelName() << " kernels";
+    }
+
     decodable_info_ = new nnet3::DecodableNnetSimpleLoopedInfo(decodable_opts_,
                                                                nnet_);
+
+    if (model_opts_.nnet_batch_size > 0) {
+        if (nnet3::NnetIsRecurrent(nnet_->GetNnet())) {
+            KALDI_WARN << "Ignoring --nnet-batch-size, batched chunks would lose "
+                          "the state of the recurrent acoustic model";
+        } else {
+            KALDI_LOG << "Computing the acoustic model in batches of " << model_opts_.nnet_batch_size << " chunks";
+            nnet_batcher_ = new NnetChunkBatcher(*decodable_info_, model_opts_.nnet_batch_size);
+        }
+    }
+}
+
+void Model::ReadIvectorExtractor()
+{
+    struct stat buffer;
+
     if (stat(final_ie_rxfilename_.c_str(), &buffer) == 0) {
         KALDI_LOG << "Loading i-vector extractor from " << final_ie_rxfilename_;
 
@@ -256,32 +452,43 @@ void Model::ReadDataFiles()
         ivector_extraction_opts.ivector_extractor_rxfilename = model_path_str_ + "/ivector/final.ie";
         ivector_extraction_opts.max_count = 100;
 
-        feature_info_.use_ivectors = true;
-        feature_info_.ivector_extractor_info.Init(ivector_extraction_opts);
+        feature_info_->use_ivectors = true;
+        feature_info_->ivector_extractor_info.Init(ivector_extraction_opts);
     } else {
-        feature_info_.use_ivectors = false;
-    }
-
-    if (stat(global_cmvn_stats_rxfilename_.c_str(), &buffer) == 0) {
-        KALDI_LOG << "Reading CMVN stats from " << global_cmvn_stats_rxfilename_;
-        feature_info_.use_cmvn = true;
-        ReadKaldiObject(global_cmvn_stats_rxfilename_, &feature_info_.global_cmvn_stats);
+        feature_info_->use_ivectors = false;
     }
+}
 
-    if (stat(pitch_conf_rxfilename_.c_str(), &buffer) == 0) {
-        KALDI_LOG << "Using pitch in feature pipeline";
-        feature_info_.add_pitch = true;
-        ReadConfigFromFile(pitch_conf_rxfilename_, &feature_info_.pitch_opts);
-    }
+void Model::ReadGraph()
+{
+    struct stat buffer;
 
     if (stat(hclg_fst_rxfilename_.c_str(), &buffer) == 0) {
-        KALDI_LOG << "Loading HCLG from " << hclg_fst_rxfilename_;
-        hclg_fst_ = fst::ReadFstKaldiGeneric(hclg_fst_rxfilename_);
+        if (model_opts_.mmap_graph) {
+            KALDI_LOG << "Mapping HCLG from " << hclg_fst_rxfilename_;
+            hclg_fst_ = ReadFstMapped(hclg_fst_rxfilename_);
+        } else {
+            KALDI_LOG << "Loading HCLG from " << hclg_fst_rxfilename_;
+            hclg_fst_ = fst::ReadFstKaldiGeneric(hclg_fst_rxfilename_);
+        }
     } else {
-        KALDI_LOG << "Loading HCL and G from " << hcl_fst_rxfilename_ << " " << g_fst_rxfilename_;
-        hcl_fst_ = fst::StdFst::Read(hcl_fst_rxfilename_);
-        g_fst_ = fst::StdFst::Read(g_fst_rxfilename_);
+        if (model_opts_.mmap_graph) {
+            KALDI_LOG << "Mapping HCL and G from " << hcl_fst_rxfilename_ << " " << g_fst_rxfilename_;
+            hcl_fst_ = ReadFstMapped(hcl_fst_rxfilename_);
+            g_fst_ = ReadFstMapped(g_fst_rxfilename_);
+        } else {
+            KALDI_LOG << "Loading HCL and G from " << hcl_fst_rxfilename_ << " " << g_fst_rxfilename_;
+            hcl_fst_ = fst::StdFst::Read(hcl_fst_rxfilename_);
+            g_fst_ = fst::StdFst::Read(g_fst_rxfilename_);
+        }
         ReadIntegerVectorSimple(disambig_rxfilename_, &disambig_);
+
+        if (model_opts_.lookahead_cache_size > 0) {
+            KALDI_LOG << "Sharing lookahead graph cache of " << model_opts_.lookahead_cache_size << " MB";
+            lookahead_cache_ = std::make_shared<FstStateCache>(
+                    LookaheadComposeFst(*hcl_fst_, *g_fst_, disambig_),
+                    (size_t)model_opts_.lookahead_cache_size << 20);
+        }
     }
 
     if (hclg_fst_ && hclg_fst_->OutputSymbols()) {
@@ -303,6 +510,11 @@ void Model::ReadDataFiles()
         kaldi::WordBoundaryInfoNewOpts opts;
         winfo_ = new kaldi::WordBoundaryInfo(opts, winfo_rxfilename_);
     }
+}
+
+void Model::ReadRescoring()
+{
+    struct stat buffer;
 
     if (stat(carpa_rxfilename_.c_str(), &buffer) == 0) {
 
@@ -311,6 +523,11 @@ void Model::ReadDataFiles()
         KALDI_LOG << "Loading CARPA model from " << carpa_rxfilename_;
         ReadKaldiObject(carpa_rxfilename_, &const_arpa_);
     }
+}
+
+void Model::ReadRnnlm()
+{
+    struct stat buffer;
 
     // RNNLM Rescoring
     if (stat(rnnlm_lm_rxfilename_.c_str(), &buffer) == 0) {
@@ -334,9 +551,10 @@ void Model::ReadDataFiles()
 
         ReadConfigFromFile(rnnlm_config_rxfilename_, &rnnlm_compute_opts);
 
+        rnnlm_cache_ = new RnnlmStateCache(rnnlm_compute_opts, rnnlm, word_embedding_mat,
+                                           std::max(model_opts_.rnnlm_cache_size, 1));
         rnnlm_enabled_ = true;
     }
-
 }
 
 void Model::Ref() 
@@ -360,10 +578,87 @@ int Model::FindWord(const char *word)
     return word_syms_->Find(word);
 }
 
+void Model::AddStats(const RecognizerStats &stats)
+{
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.Add(stats);
+}
+
+string Model::GetStats()
+{
+    RecognizerStats stats;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats = stats_;
+    }
+    json::JSON obj;
+    stats.ToJson(obj);
+    return obj.dump();
+}
+
+std::shared_ptr<const fst::StdVectorFst> Model::GetGrammarFst(const vector<vector<int32> > &sentences)
+{
+    // Grammars are keyed by word ids, so differences in spacing and ignored
+    // out-of-vocabulary words don't produce separate entries
+    string key;
+    for (const auto &sentence : sentences) {
+        for (int32 id : sentence) {
+            key += std::to_string(id);
+            key += ' ';
+        }
+        key += '\n';
+    }
+
+    if (model_opts_.grammar_cache_size > 0) {
+        std::lock_guard<std::mutex> lock(grammar_mutex_);
+        auto it = grammar_cache_.find(key);
+        if (it != grammar_cache_.end()) {
+            grammar_lru_.splice(grammar_lru_.begin(), grammar_lru_, it->second);
+            return it->second->second;
+        }
+    }
+
+    // Estimate outside of the lock so that new grammars don't block each other
+    LanguageModelOptions opts;
+
+    opts.ngram_order = 2;
+    opts.discount = 0.5;
+
+    LanguageModelEstimator estimator(opts);
+    for (const auto &sentence : sentences) {
+        estimator.AddCounts(sentence);
+    }
+    std::shared_ptr<fst::StdVectorFst> g_fst = std::make_shared<fst::StdVectorFst>();
+    estimator.Estimate(g_fst.get());
+
+    if (model_opts_.grammar_cache_size > 0) {
+        std::lock_guard<std::mutex> lock(grammar_mutex_);
+        auto it = grammar_cache_.find(key);
+        if (it != grammar_cache_.end()) {
+            grammar_lru_.splice(grammar_lru_.begin(), grammar_lru_, it->second);
+            return it->second->second;
+        }
+        grammar_lru_.emplace_front(key, g_fst);
+        grammar_cache_[key] = grammar_lru_.begin();
+        if (grammar_lru_.size() > (size_t)model_opts_.grammar_cache_size) {
+            grammar_cache_.erase(grammar_lru_.back().first);
+            grammar_lru_.pop_back();
+        }
+    }
+    return g_fst;
+}
+
 Model::~Model() {
-    delete decodable_info_;
-    delete trans_model_;
-    delete nnet_;
+    lookahead_cache_.reset();
+    if (am_model_) {
+        am_model_->Unref();
+    } else {
+        delete nnet_batcher_;
+        delete decodable_info_;
+        delete trans_model_;
+        delete nnet_;
+        delete feature_info_;
+    }
     if (word_syms_loaded_)
         delete word_syms_;
     delete winfo_;
@@ -371,4 +666,5 @@ Model::~Model() {
     delete hcl_fst_;
     delete g_fst_;
     delete graph_lm_fst_;
+    delete rnnlm_cache_;
 }
@@ -31,7 +31,15 @@
 #include "nnet3/nnet-utils.h"
 #include "rnnlm/rnnlm-utils.h"
 #include "rnnlm/rnnlm-lattice-rescoring.h"
+#include "fst_cache.h"
+#include "nnet_batcher.h"
+#include "rnnlm_cache.h"
+#include "recognizer_stats.h"
 #include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 using namespace kaldi;
 using namespace std;
@@ -39,24 +47,93 @@ using namespace std;
 class Recognizer;
 class BatchRecognizer;
 
+struct ModelOptions {
+    bool mmap_graph;
+    int32 load_threads;
+    bool print_load_timings;
+    int32 lookahead_cache_size;
+    int32 grammar_cache_size;
+    int32 rnnlm_cache_size;
+    bool quantize_acoustic_model;
+    int32 nnet_batch_size;
+
+    ModelOptions():
+        mmap_graph(false),
+        load_threads(1),
+        print_load_timings(false),
+        lookahead_cache_size(0),
+        grammar_cache_size(100),
+        rnnlm_cache_size(5000),
+        quantize_acoustic_model(false),
+        nnet_batch_size(0)
+        { }
+
+    void Register(OptionsItf *opts) {
+        opts->Register("mmap-graph", &mmap_graph, "Memory-map graph FSTs instead of "
+                       "reading them into memory. Graphs should be converted "
+                       "with 'fstconvert --fst_type=const --fst_align'");
+        opts->Register("load-threads", &load_threads, "Number of threads to load "
+                       "acoustic model, graph and rescoring models in parallel");
+        opts->Register("print-load-timings", &print_load_timings, "Log the time "
+                       "spent loading each part of the model");
+        opts->Register("lookahead-cache-size", &lookahead_cache_size, "Size in MB "
+                       "of the lookahead graph cache shared between recognizers, "
+                       "0 to compose the graph separately in every recognizer");
+        opts->Register("grammar-cache-size", &grammar_cache_size, "Number of "
+                       "recently used grammars to keep estimated for reuse "
+                       "by new recognizers, 0 to disable");
+        opts->Register("rnnlm-cache-size", &rnnlm_cache_size, "Number of "
+                       "RNNLM states shared between recognizers for rescoring");
+        opts->Register("quantize-acoustic-model", &quantize_acoustic_model, "Run the "
+                       "affine, linear and TDNN layers of the acoustic model in int8 "
+                       "on CPU, faster at a small cost in accuracy. Needs AVX512-VNNI "
+                       "or ARM dot product instructions, ignored otherwise");
+        opts->Register("nnet-batch-size", &nnet_batch_size, "Number of chunks "
+                       "of different recognizers to run through the acoustic model "
+                       "in one computation, 0 to run every recognizer separately. "
+                       "Batched chunks are computed with their full context, so "
+                       "a larger --frames-per-chunk keeps the overhead low. "
+                       "Ignored for recurrent models");
+    }
+};
+
 class Model {
 
 public:
-    Model(const char *model_path);
+    // Extra arguments override the model configuration, for example
+    // "--quantize-acoustic-model=true"
+    Model(const char *model_path, const vector<string> &extra_args = vector<string>());
+    // Loads only the graph, rescoring and RNNLM files from graph_path and
+    // shares the acoustic model, feature extraction and decoding options
+    // of am_model, which is kept alive while this model exists
+    Model(Model *am_model, const char *graph_path);
     void Ref();
     void Unref();
     int FindWord(const char *word);
+    // Sum of the statistics of all recognizers of the model as JSON
+    string GetStats();
 
 protected:
     ~Model();
     void ConfigureV1();
     void ConfigureV2();
+    void ConfigureGraph();
     void ReadDataFiles();
 
+    typedef std::pair<string, std::function<void()> > LoadStage;
+    void RunLoadStages(const vector<LoadStage> &stages);
+    void ReadAcousticModel();
+    void ReadIvectorExtractor();
+    void ReadGraph();
+    void ReadRescoring();
+    void ReadRnnlm();
+    std::shared_ptr<const fst::StdVectorFst> GetGrammarFst(const vector<vector<int32> > &sentences);
+
     friend class Recognizer;
     friend class BatchRecognizer;
 
     string model_path_str_;
+    vector<string> extra_args_;
     string nnet3_rxfilename_;
     string hclg_fst_rxfilename_;
     string hcl_fst_rxfilename_;
@@ -77,12 +154,16 @@ protected:
     string rnnlm_config_rxfilename_;
     string rnnlm_lm_rxfilename_;
 
+    ModelOptions model_opts_;
     kaldi::OnlineEndpointConfig endpoint_config_;
     kaldi::LatticeFasterDecoderConfig nnet3_decoding_config_;
     kaldi::nnet3::NnetSimpleLoopedComputationOptions decodable_opts_;
-    kaldi::OnlineNnet2FeaturePipelineInfo feature_info_;
+    kaldi::OnlineNnet2FeaturePipelineInfo *feature_info_ = nullptr;
 
+    // Owner of the acoustic model members above when they are shared
+    Model *am_model_ = nullptr;
     kaldi::nnet3::DecodableNnetSimpleLoopedInfo *decodable_info_ = nullptr;
+    NnetChunkBatcher *nnet_batcher_ = nullptr;
     kaldi::TransitionModel *trans_model_ = nullptr;
     kaldi::nnet3::AmNnetSimple *nnet_ = nullptr;
     const fst::SymbolTable *word_syms_ = nullptr;
@@ -93,6 +174,7 @@ protected:
     fst::Fst<fst::StdArc> *hclg_fst_ = nullptr;
     fst::Fst<fst::StdArc> *hcl_fst_ = nullptr;
     fst::Fst<fst::StdArc> *g_fst_ = nullptr;
+    std::shared_ptr<FstStateCache> lookahead_cache_;
 
     fst::VectorFst<fst::StdArc> *graph_lm_fst_ = nullptr;
     kaldi::ConstArpaLm const_arpa_;
@@ -101,6 +183,17 @@ protected:
     CuMatrix<BaseFloat> word_embedding_mat;
     kaldi::nnet3::Nnet rnnlm;
     bool rnnlm_enabled_ = false;
+    RnnlmStateCache *rnnlm_cache_ = nullptr;
+
+    // Estimated grammars shared between recognizers, most recently used first
+    typedef std::list<std::pair<string, std::shared_ptr<const fst::StdVectorFst> > > GrammarList;
+    GrammarList grammar_lru_;
+    std::unordered_map<string, GrammarList::iterator> grammar_cache_;
+    std::mutex grammar_mutex_;
+
+    void AddStats(const RecognizerStats &stats);
+    RecognizerStats stats_;
+    std::mutex stats_mutex_;
 
     std::atomic<int> ref_cnt_;
 };
@@ -0,0 +1,63 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "model_registry.h"
+
+ModelRegistry::ModelRegistry(Model *model) : model_(model), version_(1), ref_cnt_(1)
+{
+    model_->Ref();
+}
+
+ModelRegistry::~ModelRegistry()
+{
+    model_->Unref();
+}
+
+void ModelRegistry::Ref()
+{
+    std::atomic_fetch_add_explicit(&ref_cnt_, 1, std::memory_order_relaxed);
+}
+
+void ModelRegistry::Unref()
+{
+    if (std::atomic_fetch_sub_explicit(&ref_cnt_, 1, std::memory_order_release) == 1) {
+         std::atomic_thread_fence(std::memory_order_acquire);
+         delete this;
+    }
+}
+
+Model *ModelRegistry::Acquire(int *version)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    model_->Ref();
+    *version = version_.load(std::memory_order_relaxed);
+    return model_;
+}
+
+int ModelRegistry::Swap(Model *model)
+{
+    model->Ref();
+    Model *old_model;
+    int version;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        old_model = model_;
+        model_ = model;
+        version = version_.fetch_add(1, std::memory_order_release) + 1;
+    }
+    // Recognizers still decoding with the old model keep it alive
+    old_model->Unref();
+    KALDI_LOG << "Model registry switched to version " << version;
+    return version;
+}
@@ -0,0 +1,47 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_MODEL_REGISTRY_H
+#define VOSK_MODEL_REGISTRY_H
+
+#include "model.h"
+
+#include <atomic>
+#include <mutex>
+
+// Holds the current version of a model. Recognizers created from the
+// registry move to the new model at their next utterance boundary after
+// a swap, the old model is released by the last recognizer using it.
+class ModelRegistry {
+    public:
+        explicit ModelRegistry(Model *model);
+        void Ref();
+        void Unref();
+
+        // Returns the current model with a reference taken for the caller
+        Model *Acquire(int *version);
+        // Makes the model current, returns the new version
+        int Swap(Model *model);
+        int Version() const { return version_.load(std::memory_order_acquire); }
+
+    private:
+        ~ModelRegistry();
+
+        std::mutex mutex_;
+        Model *model_;
+        std::atomic<int> version_;
+        std::atomic<int> ref_cnt_;
+};
+
+#endif /* VOSK_MODEL_REGISTRY_H */
@@ -0,0 +1,278 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "nnet_batcher.h"
+#include "lat/determinize-lattice-pruned.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace kaldi;
+using namespace kaldi::nnet3;
+
+// Time to wait for the chunks of other recognizers before computing
+// a partial minibatch
+static const int kMaxWaitMicroseconds = 2000;
+
+// Chunks of one recognizer submitted at once, when a lot of audio comes
+// in one call
+static const int kMaxChunks = 16;
+
+NnetBatchComputerOptions NnetChunkBatcher::GetOptions(const DecodableNnetSimpleLoopedInfo &info,
+                                                      int32 minibatch_size)
+{
+    NnetBatchComputerOptions opts;
+    opts.frame_subsampling_factor = info.opts.frame_subsampling_factor;
+    opts.frames_per_chunk = info.frames_per_chunk;
+    opts.optimize_config = info.opts.optimize_config;
+    opts.compute_config = info.opts.compute_config;
+    // Priors and the acoustic scale are applied by the decodable
+    opts.acoustic_scale = 1.0;
+    opts.minibatch_size = minibatch_size;
+    opts.edge_minibatch_size = minibatch_size;
+    return opts;
+}
+
+NnetChunkBatcher::NnetChunkBatcher(const DecodableNnetSimpleLoopedInfo &info,
+                                   int32 minibatch_size) :
+    info_(info),
+    left_context_(info.frames_left_context),
+    right_context_(info.frames_right_context),
+    log_priors_(info.log_priors.Dim()),
+    computer_(GetOptions(info, minibatch_size), info.nnet, Vector<BaseFloat>())
+{
+    info.log_priors.CopyToVec(&log_priors_);
+}
+
+void NnetChunkBatcher::Notify()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation_++;
+    }
+    cond_.notify_all();
+}
+
+void NnetChunkBatcher::Compute(std::vector<NnetInferenceTask> *tasks)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::microseconds(kMaxWaitMicroseconds);
+    // Earlier chunks first
+    double priority = -std::chrono::duration<double>(start.time_since_epoch()).count();
+    for (NnetInferenceTask &task : *tasks) {
+        task.priority = priority;
+        computer_.AcceptTask(&task);
+    }
+    // The new chunks may complete a minibatch for a waiting thread
+    Notify();
+
+    size_t done = 0;
+    while (true) {
+        // Taken before the checks, so a notification after them is not lost
+        uint64 generation;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            generation = generation_;
+        }
+
+        while (done < tasks->size() && (*tasks)[done].semaphore.TryWait()) {
+            done++;
+        }
+        if (done == tasks->size()) {
+            return;
+        }
+
+        bool partial = std::chrono::steady_clock::now() >= deadline;
+        if (computer_.Compute(partial)) {
+            Notify();
+            continue;
+        }
+
+        // Sleep until chunks are added or computed. After the deadline
+        // the remaining chunks are in a computation of another thread.
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto changed = [&]() { return generation_ != generation; };
+        if (partial) {
+            cond_.wait(lock, changed);
+        } else {
+            cond_.wait_until(lock, deadline, changed);
+        }
+    }
+}
+
+DecodableNnetBatchedOnline::DecodableNnetBatchedOnline(NnetChunkBatcher *batcher,
+                                                       const TransitionModel &trans_model,
+                                                       OnlineFeatureInterface *input_features,
+                                                       OnlineFeatureInterface *ivector_features) :
+    batcher_(batcher), trans_model_(trans_model),
+    input_features_(input_features), ivector_features_(ivector_features)
+{
+    if (batcher_->Info().has_ivectors && ivector_features_ == nullptr) {
+        KALDI_ERR << "The acoustic model needs i-vectors but the features have none";
+    }
+}
+
+// Same as in DecodableAmNnetLoopedOnline, a chunk is ready when the
+// features of its right context are
+int32 DecodableNnetBatchedOnline::NumFramesReady() const
+{
+    const DecodableNnetSimpleLoopedInfo &info = batcher_->Info();
+    int32 features_ready = input_features_->NumFramesReady();
+    if (features_ready == 0)
+        return 0;
+    int32 sf = info.opts.frame_subsampling_factor;
+    if (input_features_->IsLastFrame(features_ready - 1)) {
+        return (features_ready + sf - 1) / sf - frame_offset_;
+    }
+    int32 frames_ready = std::max<int32>(0, features_ready - batcher_->FramesRightContext());
+    return frames_ready / info.frames_per_chunk * info.frames_per_chunk / sf - frame_offset_;
+}
+
+bool DecodableNnetBatchedOnline::IsLastFrame(int32 subsampled_frame) const
+{
+    int32 features_ready = input_features_->NumFramesReady();
+    if (features_ready == 0 || !input_features_->IsLastFrame(features_ready - 1))
+        return false;
+    int32 sf = batcher_->Info().opts.frame_subsampling_factor;
+    return subsampled_frame + frame_offset_ == (features_ready + sf - 1) / sf - 1;
+}
+
+void DecodableNnetBatchedOnline::SetFrameOffset(int32 frame_offset)
+{
+    KALDI_ASSERT(frame_offset >= 0);
+    frame_offset_ = frame_offset;
+}
+
+BaseFloat DecodableNnetBatchedOnline::LogLikelihood(int32 subsampled_frame, int32 transition_id)
+{
+    int32 frame = subsampled_frame + frame_offset_;
+    if (frame < log_post_offset_ || frame >= log_post_offset_ + log_post_.NumRows()) {
+        const DecodableNnetSimpleLoopedInfo &info = batcher_->Info();
+        ComputeChunks(frame / (info.frames_per_chunk / info.opts.frame_subsampling_factor));
+    }
+    return log_post_(frame - log_post_offset_, trans_model_.TransitionIdToPdfFast(transition_id));
+}
+
+// Input frames outside of the features are replaced with the first and
+// the last frame, like in the looped computation, so the chunks at the
+// edges have the same shape as the others
+void DecodableNnetBatchedOnline::ComputeChunks(int32 first_chunk)
+{
+    const DecodableNnetSimpleLoopedInfo &info = batcher_->Info();
+    int32 sf = info.opts.frame_subsampling_factor;
+    int32 chunk_frames = info.frames_per_chunk / sf;
+    int32 left_context = batcher_->FramesLeftContext();
+    int32 num_input_frames = left_context + (chunk_frames - 1) * sf + 1 + batcher_->FramesRightContext();
+
+    int32 features_ready = input_features_->NumFramesReady();
+    int32 frames_ready = NumFramesReady() + frame_offset_;
+    int32 num_chunks = (frames_ready + chunk_frames - 1) / chunk_frames - first_chunk;
+    num_chunks = std::min(std::max(num_chunks, 1), kMaxChunks);
+
+    // The most recent i-vector as in the looped computation
+    Vector<BaseFloat> ivector;
+    if (info.has_ivectors) {
+        ivector.Resize(ivector_features_->Dim());
+        int32 ivector_frames_ready = ivector_features_->NumFramesReady();
+        if (ivector_frames_ready > 0) {
+            ivector_features_->GetFrame(std::min(features_ready, ivector_frames_ready) - 1, &ivector);
+        }
+    }
+
+    std::vector<NnetInferenceTask> tasks(num_chunks);
+    std::vector<int32> frames(num_input_frames);
+    for (int32 i = 0; i < num_chunks; i++) {
+        NnetInferenceTask &task = tasks[i];
+        int32 begin_input_frame = (first_chunk + i) * info.frames_per_chunk - left_context;
+        for (int32 t = 0; t < num_input_frames; t++) {
+            frames[t] = std::min(std::max(begin_input_frame + t, 0), features_ready - 1);
+        }
+        Matrix<BaseFloat> input(num_input_frames, input_features_->Dim(), kUndefined);
+        input_features_->GetFrames(frames, &input);
+        task.input.Swap(&input);
+        if (info.has_ivectors) {
+            task.ivector.Resize(ivector.Dim(), kUndefined);
+            task.ivector.CopyFromVec(ivector);
+        }
+        task.first_input_t = -left_context;
+        task.output_t_stride = sf;
+        task.num_output_frames = chunk_frames;
+        task.num_initial_unused_output_frames = 0;
+        task.num_used_output_frames = chunk_frames;
+        task.first_used_output_frame_index = (first_chunk + i) * chunk_frames;
+        task.is_edge = false;
+        task.is_irregular = false;
+        task.output_to_cpu = true;
+    }
+
+    batcher_->Compute(&tasks);
+
+    log_post_.Resize(num_chunks * chunk_frames, tasks[0].output_cpu.NumCols(), kUndefined);
+    for (int32 i = 0; i < num_chunks; i++) {
+        log_post_.RowRange(i * chunk_frames, chunk_frames).CopyFromMat(tasks[i].output_cpu);
+    }
+    if (batcher_->LogPriors().Dim() != 0) {
+        log_post_.AddVecToRows(-1.0, batcher_->LogPriors());
+    }
+    log_post_.Scale(info.opts.acoustic_scale);
+    log_post_offset_ = first_chunk * chunk_frames;
+}
+
+OnlineNnet3Decoder::OnlineNnet3Decoder(const LatticeFasterDecoderConfig &decoder_opts,
+                                       const TransitionModel &trans_model,
+                                       const DecodableNnetSimpleLoopedInfo &info,
+                                       NnetChunkBatcher *batcher,
+                                       const fst::Fst<fst::StdArc> &fst,
+                                       OnlineNnet2FeaturePipeline *features) :
+    decoder_opts_(decoder_opts),
+    trans_model_(trans_model),
+    output_frame_shift_(features->FrameShiftInSeconds() * info.opts.frame_subsampling_factor),
+    decoder_(fst, decoder_opts)
+{
+    if (batcher) {
+        batched_.reset(new DecodableNnetBatchedOnline(batcher, trans_model,
+                                                      features->InputFeature(), features->IvectorFeature()));
+        decodable_ = batched_.get();
+    } else {
+        looped_.reset(new DecodableAmNnetLoopedOnline(trans_model, info,
+                                                      features->InputFeature(), features->IvectorFeature()));
+        decodable_ = looped_.get();
+    }
+    decoder_.InitDecoding();
+}
+
+void OnlineNnet3Decoder::InitDecoding(int32 frame_offset)
+{
+    decoder_.InitDecoding();
+    if (batched_) {
+        batched_->SetFrameOffset(frame_offset);
+    } else {
+        looped_->SetFrameOffset(frame_offset);
+    }
+}
+
+bool OnlineNnet3Decoder::EndpointDetected(const OnlineEndpointConfig &config)
+{
+    return kaldi::EndpointDetected(config, trans_model_, output_frame_shift_, decoder_);
+}
+
+void OnlineNnet3Decoder::GetLattice(bool end_of_utterance, CompactLattice *clat) const
+{
+    if (NumFramesDecoded() == 0)
+        KALDI_ERR << "You cannot get a lattice if you decoded no frames.";
+    Lattice raw_lat;
+    decoder_.GetRawLattice(&raw_lat, end_of_utterance);
+    DeterminizeLatticePhonePrunedWrapper(trans_model_, &raw_lat, decoder_opts_.lattice_beam,
+                                         clat, decoder_opts_.det_opts);
+}
@@ -0,0 +1,138 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_NNET_BATCHER_H
+#define VOSK_NNET_BATCHER_H
+
+#include "base/kaldi-common.h"
+#include "itf/decodable-itf.h"
+#include "itf/online-feature-itf.h"
+#include "hmm/transition-model.h"
+#include "decoder/lattice-faster-online-decoder.h"
+#include "lat/kaldi-lattice.h"
+#include "nnet3/decodable-online-looped.h"
+#include "nnet3/nnet-batch-compute.h"
+#include "online2/online-endpoint.h"
+#include "online2/online-nnet2-feature-pipeline.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Runs the acoustic model on the chunks of many recognizers together.
+// Chunks are computed without the looped state, each with its full left
+// and right context, so the chunks of all streams have the same shape and
+// go to one batched computation. There is no compute thread, a recognizer
+// thread waiting for its chunks computes the queued minibatches, partial
+// ones only when no other chunks arrive for a short time. In between the
+// thread sleeps until chunks are added or a computation finishes.
+class NnetChunkBatcher {
+    public:
+        NnetChunkBatcher(const kaldi::nnet3::DecodableNnetSimpleLoopedInfo &info,
+                         int32 minibatch_size);
+
+        // Returns when all tasks are computed
+        void Compute(std::vector<kaldi::nnet3::NnetInferenceTask> *tasks);
+
+        const kaldi::nnet3::DecodableNnetSimpleLoopedInfo &Info() const { return info_; }
+        int32 FramesLeftContext() const { return left_context_; }
+        int32 FramesRightContext() const { return right_context_; }
+        const kaldi::Vector<kaldi::BaseFloat> &LogPriors() const { return log_priors_; }
+
+    private:
+        // Wakes the waiting threads after the queue changed
+        void Notify();
+
+        static kaldi::nnet3::NnetBatchComputerOptions GetOptions(
+            const kaldi::nnet3::DecodableNnetSimpleLoopedInfo &info, int32 minibatch_size);
+
+        const kaldi::nnet3::DecodableNnetSimpleLoopedInfo &info_;
+        int32 left_context_;
+        int32 right_context_;
+        kaldi::Vector<kaldi::BaseFloat> log_priors_;
+        kaldi::nnet3::NnetBatchComputer computer_;
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        uint64 generation_ = 0;
+};
+
+// Decodable of a recognizer which computes its chunks in the batcher,
+// the same interface as DecodableAmNnetLoopedOnline. All chunks ready
+// in the features are submitted together.
+class DecodableNnetBatchedOnline : public kaldi::DecodableInterface {
+    public:
+        DecodableNnetBatchedOnline(NnetChunkBatcher *batcher,
+                                   const kaldi::TransitionModel &trans_model,
+                                   kaldi::OnlineFeatureInterface *input_features,
+                                   kaldi::OnlineFeatureInterface *ivector_features);
+
+        kaldi::BaseFloat LogLikelihood(int32 subsampled_frame, int32 transition_id) override;
+        int32 NumFramesReady() const override;
+        bool IsLastFrame(int32 subsampled_frame) const override;
+        int32 NumIndices() const override { return trans_model_.NumTransitionIds(); }
+
+        void SetFrameOffset(int32 frame_offset);
+        int32 FrameSubsamplingFactor() const { return batcher_->Info().opts.frame_subsampling_factor; }
+
+    private:
+        void ComputeChunks(int32 first_chunk);
+
+        NnetChunkBatcher *batcher_;
+        const kaldi::TransitionModel &trans_model_;
+        kaldi::OnlineFeatureInterface *input_features_;
+        kaldi::OnlineFeatureInterface *ivector_features_;
+        int32 frame_offset_ = 0;
+
+        // Log-likelihoods of the last computed chunks, starting from the
+        // subsampled frame log_post_offset_ counted without frame_offset_
+        kaldi::Matrix<kaldi::BaseFloat> log_post_;
+        int32 log_post_offset_ = 0;
+};
+
+// SingleUtteranceNnet3Decoder with the acoustic model computed either by
+// the looped decodable of the recognizer or in the batches of the model
+class OnlineNnet3Decoder {
+    public:
+        // Computes the chunks in batcher unless it is null
+        OnlineNnet3Decoder(const kaldi::LatticeFasterDecoderConfig &decoder_opts,
+                           const kaldi::TransitionModel &trans_model,
+                           const kaldi::nnet3::DecodableNnetSimpleLoopedInfo &info,
+                           NnetChunkBatcher *batcher,
+                           const fst::Fst<fst::StdArc> &fst,
+                           kaldi::OnlineNnet2FeaturePipeline *features);
+
+        void InitDecoding(int32 frame_offset = 0);
+        void AdvanceDecoding() { decoder_.AdvanceDecoding(decodable_); }
+        void FinalizeDecoding() { decoder_.FinalizeDecoding(); }
+        int32 NumFramesDecoded() const { return decoder_.NumFramesDecoded(); }
+        bool EndpointDetected(const kaldi::OnlineEndpointConfig &config);
+        void GetLattice(bool end_of_utterance, kaldi::CompactLattice *clat) const;
+        void GetBestPath(bool end_of_utterance, kaldi::Lattice *best_path) const {
+            decoder_.GetBestPath(best_path, end_of_utterance);
+        }
+        const kaldi::LatticeFasterOnlineDecoder &Decoder() const { return decoder_; }
+
+    private:
+        const kaldi::LatticeFasterDecoderConfig &decoder_opts_;
+        const kaldi::TransitionModel &trans_model_;
+        kaldi::BaseFloat output_frame_shift_;
+        std::unique_ptr<kaldi::nnet3::DecodableAmNnetLoopedOnline> looped_;
+        std::unique_ptr<DecodableNnetBatchedOnline> batched_;
+        kaldi::DecodableInterface *decodable_;
+        kaldi::LatticeFasterOnlineDecoder decoder_;
+};
+
+#endif /* VOSK_NNET_BATCHER_H */
@@ -0,0 +1,399 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "quantized_nnet.h"
+#if HAVE_CUDA
+#include "cudamatrix/cu-device.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+
+// x86 kernels are compiled for their instruction sets with target
+// attributes and chosen at runtime, so the default build uses them too.
+// ARM kernels are chosen at compile time, NEON is always available on
+// aarch64 and the dot product instructions need -march=armv8.2-a+dotprod.
+// The generic kernels are kept for correctness, the model is only
+// quantized when the CPU has int8 dot product instructions.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VOSK_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define VOSK_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+// Rows are padded to a multiple of the widest kernel step
+static const int32 kRowAlign = 64;
+
+// Scale of the quantized values, 127 keeps the range symmetric and the
+// pairwise int16 sums of the kernels below free of overflow
+static const float kQuantMax = 127.0f;
+
+static float MaxAbsDefault(const float *x, int32 n)
+{
+    int32 i = 0;
+    float max = 0;
+#if VOSK_NEON_KERNELS
+    float32x4_t vmax = vdupq_n_f32(0);
+    for (; i + 4 <= n; i += 4) {
+        vmax = vmaxq_f32(vmax, vabsq_f32(vld1q_f32(x + i)));
+    }
+    max = vmaxvq_f32(vmax);
+#endif
+    for (; i < n; i++) {
+        max = std::max(max, std::fabs(x[i]));
+    }
+    return max;
+}
+
+static void QuantizeRowDefault(const float *x, int32 n, float inv_scale, int8_t *q)
+{
+    int32 i = 0;
+#if VOSK_NEON_KERNELS
+    for (; i + 8 <= n; i += 8) {
+        int32x4_t a = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(x + i), inv_scale));
+        int32x4_t b = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(x + i + 4), inv_scale));
+        vst1_s8(q + i, vqmovn_s16(vcombine_s16(vqmovn_s32(a), vqmovn_s32(b))));
+    }
+#endif
+    for (; i < n; i++) {
+        q[i] = static_cast<int8_t>(std::lrint(x[i] * inv_scale));
+    }
+}
+
+// Dot products of the padded row x with the four rows of w starting
+// at w with the given stride, n is a multiple of kRowAlign
+static void Dot4Default(const int8_t *x, const int8_t *w, size_t w_stride, int32 n, int32 *out)
+{
+#if VOSK_NEON_KERNELS
+    int32x4_t sum[4];
+    for (int k = 0; k < 4; k++) {
+        sum[k] = vdupq_n_s32(0);
+    }
+    for (int32 i = 0; i < n; i += 16) {
+        int8x16_t a = vld1q_s8(x + i);
+        for (int k = 0; k < 4; k++) {
+            int8x16_t b = vld1q_s8(w + k * w_stride + i);
+#if defined(__ARM_FEATURE_DOTPROD)
+            sum[k] = vdotq_s32(sum[k], a, b);
+#else
+            int16x8_t p = vmull_s8(vget_low_s8(a), vget_low_s8(b));
+            p = vmlal_high_s8(p, a, b);
+            sum[k] = vpadalq_s16(sum[k], p);
+#endif
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        out[k] = vaddvq_s32(sum[k]);
+    }
+#else
+    for (int k = 0; k < 4; k++) {
+        const int8_t *row = w + k * w_stride;
+        int32 sum = 0;
+        for (int32 i = 0; i < n; i++) {
+            sum += static_cast<int32>(x[i]) * row[i];
+        }
+        out[k] = sum;
+    }
+#endif
+}
+
+#if VOSK_X86_KERNELS
+__attribute__((target("avx2")))
+static float MaxAbsAvx2(const float *x, int32 n)
+{
+    int32 i = 0;
+    __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 vmax = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_and_ps(_mm256_loadu_ps(x + i), mask));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vmax);
+    float max = 0;
+    for (int j = 0; j < 8; j++) {
+        max = std::max(max, lanes[j]);
+    }
+    for (; i < n; i++) {
+        max = std::max(max, std::fabs(x[i]));
+    }
+    return max;
+}
+
+__attribute__((target("avx2")))
+static void QuantizeRowAvx2(const float *x, int32 n, float inv_scale, int8_t *q)
+{
+    int32 i = 0;
+    __m256 vinv = _mm256_set1_ps(inv_scale);
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(x + i), vinv));
+        __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(x + i + 8), vinv));
+        // packs works within 128-bit lanes, restore the order
+        __m256i s16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        __m128i s8 = _mm_packs_epi16(_mm256_castsi256_si128(s16), _mm256_extracti128_si256(s16, 1));
+        _mm_storeu_si128((__m128i *)(q + i), s8);
+    }
+    for (; i < n; i++) {
+        q[i] = static_cast<int8_t>(std::lrint(x[i] * inv_scale));
+    }
+}
+
+// The input is made unsigned by flipping the sign bit, which adds 128 to
+// every value, so one instruction multiplies and adds 64 bytes. The caller
+// subtracts 128 times the sum of the weight row.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void Dot4Vnni(const int8_t *x, const int8_t *w, size_t w_stride, int32 n, int32 *out)
+{
+    const __m512i flip = _mm512_set1_epi8(static_cast<char>(0x80));
+    __m512i sum0 = _mm512_setzero_si512();
+    __m512i sum1 = _mm512_setzero_si512();
+    __m512i sum2 = _mm512_setzero_si512();
+    __m512i sum3 = _mm512_setzero_si512();
+    for (int32 i = 0; i < n; i += 64) {
+        __m512i a = _mm512_xor_si512(_mm512_loadu_si512(x + i), flip);
+        sum0 = _mm512_dpbusd_epi32(sum0, a, _mm512_loadu_si512(w + i));
+        sum1 = _mm512_dpbusd_epi32(sum1, a, _mm512_loadu_si512(w + w_stride + i));
+        sum2 = _mm512_dpbusd_epi32(sum2, a, _mm512_loadu_si512(w + 2 * w_stride + i));
+        sum3 = _mm512_dpbusd_epi32(sum3, a, _mm512_loadu_si512(w + 3 * w_stride + i));
+    }
+    out[0] = _mm512_reduce_add_epi32(sum0);
+    out[1] = _mm512_reduce_add_epi32(sum1);
+    out[2] = _mm512_reduce_add_epi32(sum2);
+    out[3] = _mm512_reduce_add_epi32(sum3);
+}
+#endif
+
+struct QuantizedKernels {
+    float (*max_abs)(const float *x, int32 n);
+    void (*quantize_row)(const float *x, int32 n, float inv_scale, int8_t *q);
+    void (*dot4)(const int8_t *x, const int8_t *w, size_t w_stride, int32 n, int32 *out);
+    int32 input_offset; // Added to the inputs by dot4
+    const char *name;
+    // Single instruction int8 dot products, other kernels are slower
+    // than the float matrix multiplication of the BLAS library
+    bool faster_than_float;
+};
+
+static QuantizedKernels SelectKernels()
+{
+#if VOSK_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) {
+        return { MaxAbsAvx2, QuantizeRowAvx2, Dot4Vnni, 128, "AVX512-VNNI", true };
+    }
+    return { MaxAbsDefault, QuantizeRowDefault, Dot4Default, 0, "generic", false };
+#elif VOSK_NEON_KERNELS && defined(__ARM_FEATURE_DOTPROD)
+    return { MaxAbsDefault, QuantizeRowDefault, Dot4Default, 0, "NEON dot product", true };
+#elif VOSK_NEON_KERNELS
+    return { MaxAbsDefault, QuantizeRowDefault, Dot4Default, 0, "NEON", false };
+#else
+    return { MaxAbsDefault, QuantizeRowDefault, Dot4Default, 0, "generic", false };
+#endif
+}
+
+static const QuantizedKernels &Kernels()
+{
+    static const QuantizedKernels kernels = SelectKernels();
+    return kernels;
+}
+
+const char *QuantizedKernelName()
+{
+    return Kernels().name;
+}
+
+void QuantizedRows::Quantize(const BaseFloat *m, int32 rows, int32 cols, int32 m_stride)
+{
+    num_rows = rows;
+    num_cols = cols;
+    stride = (cols + kRowAlign - 1) / kRowAlign * kRowAlign;
+    data.assign(static_cast<size_t>(rows) * stride, 0);
+    scales.resize(rows);
+    const QuantizedKernels &kernels = Kernels();
+    for (int32 r = 0; r < rows; r++) {
+        const BaseFloat *row = m + static_cast<size_t>(r) * m_stride;
+        float max = kernels.max_abs(row, cols);
+        if (max == 0) {
+            scales[r] = 0;
+            continue;
+        }
+        scales[r] = max / kQuantMax;
+        kernels.quantize_row(row, cols, kQuantMax / max, data.data() + static_cast<size_t>(r) * stride);
+    }
+}
+
+void QuantizedMatrix::Init(const MatrixBase<BaseFloat> &m)
+{
+    weights_.Quantize(m);
+    // Zero rows up to a multiple of 4 for the kernels
+    int32 padded_rows = (weights_.num_rows + 3) / 4 * 4;
+    weights_.data.resize(static_cast<size_t>(padded_rows) * weights_.stride, 0);
+
+    // Correction for the kernels which shift the input
+    int32 input_offset = Kernels().input_offset;
+    offsets_.resize(weights_.num_rows);
+    for (int32 o = 0; o < weights_.num_rows; o++) {
+        const int8_t *w = weights_.Row(o);
+        int32 sum = 0;
+        for (int32 i = 0; i < weights_.num_cols; i++) {
+            sum += w[i];
+        }
+        offsets_[o] = input_offset * sum;
+    }
+}
+
+void QuantizedMatrix::AddMatMatTrans(const QuantizedRows &in, int32 row_offset, int32 row_stride,
+                                     MatrixBase<BaseFloat> *out) const
+{
+    KALDI_ASSERT(in.num_cols == weights_.num_cols && out->NumCols() == weights_.num_rows);
+    KALDI_ASSERT(row_offset + row_stride * (out->NumRows() - 1) < in.num_rows);
+
+    // Four weight rows are applied to a block of frames at a time, the
+    // input row is loaded once for the four dot products and the outputs
+    // are written contiguously. The weight rows stay in L1 for the block.
+    const int32 kFrameBlock = 16;
+    void (*dot4)(const int8_t *, const int8_t *, size_t, int32, int32 *) = Kernels().dot4;
+    int32 num_rows = out->NumRows();
+    int32 num_outputs = weights_.num_rows;
+    for (int32 r0 = 0; r0 < num_rows; r0 += kFrameBlock) {
+        int32 r1 = std::min(num_rows, r0 + kFrameBlock);
+        for (int32 o = 0; o < num_outputs; o += 4) {
+            const int8_t *w = weights_.Row(o);
+            int32 n = std::min(4, num_outputs - o);
+            for (int32 r = r0; r < r1; r++) {
+                int32 row = row_offset + r * row_stride;
+                int32 dot[4];
+                dot4(in.Row(row), w, weights_.stride, weights_.stride, dot);
+                float in_scale = in.scales[row];
+                BaseFloat *out_row = out->RowData(r) + o;
+                for (int32 k = 0; k < n; k++) {
+                    out_row[k] += (dot[k] - offsets_[o + k]) * (in_scale * weights_.scales[o + k]);
+                }
+            }
+        }
+    }
+}
+
+QuantizedAffineComponent::QuantizedAffineComponent(const nnet3::AffineComponent &other):
+    nnet3::AffineComponent(other)
+{
+    weights_.Init(LinearParams().Mat());
+}
+
+void* QuantizedAffineComponent::Propagate(const nnet3::ComponentPrecomputedIndexes *indexes,
+                                          const CuMatrixBase<BaseFloat> &in,
+                                          CuMatrixBase<BaseFloat> *out) const
+{
+#if HAVE_CUDA
+    if (CuDevice::Instantiate().Enabled())
+        return nnet3::AffineComponent::Propagate(indexes, in, out);
+#endif
+    QuantizedRows input;
+    input.Quantize(in.Mat());
+    out->CopyRowsFromVec(BiasParams());
+    weights_.AddMatMatTrans(input, 0, 1, &out->Mat());
+    return NULL;
+}
+
+QuantizedLinearComponent::QuantizedLinearComponent(const nnet3::LinearComponent &other):
+    nnet3::LinearComponent(other)
+{
+    weights_.Init(Params().Mat());
+}
+
+void* QuantizedLinearComponent::Propagate(const nnet3::ComponentPrecomputedIndexes *indexes,
+                                          const CuMatrixBase<BaseFloat> &in,
+                                          CuMatrixBase<BaseFloat> *out) const
+{
+#if HAVE_CUDA
+    if (CuDevice::Instantiate().Enabled())
+        return nnet3::LinearComponent::Propagate(indexes, in, out);
+#endif
+    // Like the float version this adds to the output (kPropagateAdds)
+    QuantizedRows input;
+    input.Quantize(in.Mat());
+    weights_.AddMatMatTrans(input, 0, 1, &out->Mat());
+    return NULL;
+}
+
+QuantizedTdnnComponent::QuantizedTdnnComponent(const nnet3::TdnnComponent &other):
+    nnet3::TdnnComponent(other)
+{
+    int32 input_dim = InputDim();
+    const CuMatrixBase<BaseFloat> &params = LinearParams();
+    int32 num_offsets = params.NumCols() / input_dim;
+    weights_.resize(num_offsets);
+    for (int32 i = 0; i < num_offsets; i++) {
+        weights_[i].Init(params.Mat().ColRange(i * input_dim, input_dim));
+    }
+    bias_ = BiasParams().Vec();
+}
+
+void* QuantizedTdnnComponent::Propagate(const nnet3::ComponentPrecomputedIndexes *indexes_in,
+                                        const CuMatrixBase<BaseFloat> &in,
+                                        CuMatrixBase<BaseFloat> *out) const
+{
+#if HAVE_CUDA
+    if (CuDevice::Instantiate().Enabled())
+        return nnet3::TdnnComponent::Propagate(indexes_in, in, out);
+#endif
+    const PrecomputedIndexes *indexes = dynamic_cast<const PrecomputedIndexes*>(indexes_in);
+    KALDI_ASSERT(indexes != NULL && indexes->row_offsets.size() == weights_.size());
+
+    // Same as the float version: the bias is copied, without a bias the
+    // component adds to the output. The input rows of all time offsets
+    // overlap, so they are quantized once.
+    if (bias_.Dim() != 0)
+        out->Mat().CopyRowsFromVec(bias_);
+    QuantizedRows input;
+    input.Quantize(in.Mat());
+    for (size_t i = 0; i < weights_.size(); i++) {
+        weights_[i].AddMatMatTrans(input, indexes->row_offsets[i], indexes->row_stride, &out->Mat());
+    }
+    return NULL;
+}
+
+int32 QuantizeNnet(nnet3::Nnet *nnet)
+{
+    int32 num_quantized = 0;
+    if (!Kernels().faster_than_float) {
+        KALDI_WARN << "No int8 dot product instructions on this CPU, "
+                   << "keeping the float acoustic model";
+        return num_quantized;
+    }
+    for (int32 c = 0; c < nnet->NumComponents(); c++) {
+        if (nnet->GetComponentName(c).compare(0, 6, "output") == 0)
+            continue;
+
+        nnet3::Component *component = nnet->GetComponent(c);
+        std::string type = component->Type();
+        nnet3::Component *quantized = nullptr;
+        if (type == "AffineComponent" || type == "NaturalGradientAffineComponent") {
+            quantized = new QuantizedAffineComponent(
+                *dynamic_cast<nnet3::AffineComponent*>(component));
+        } else if (type == "LinearComponent") {
+            quantized = new QuantizedLinearComponent(
+                *dynamic_cast<nnet3::LinearComponent*>(component));
+        } else if (type == "TdnnComponent") {
+            quantized = new QuantizedTdnnComponent(
+                *dynamic_cast<nnet3::TdnnComponent*>(component));
+        }
+        if (quantized) {
+            nnet->SetComponent(c, quantized);
+            num_quantized++;
+        }
+    }
+    return num_quantized;
+}
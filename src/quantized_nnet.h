@@ -0,0 +1,111 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_QUANTIZED_NNET_H
+#define VOSK_QUANTIZED_NNET_H
+
+#include "base/kaldi-common.h"
+#include "nnet3/nnet-nnet.h"
+#include "nnet3/nnet-simple-component.h"
+#include "nnet3/nnet-convolutional-component.h"
+
+#include <cstdint>
+#include <vector>
+
+using namespace kaldi;
+
+// Rows of a matrix quantized to int8 with a symmetric scale per row,
+// rows are padded with zeros so the kernels don't need a tail loop.
+struct QuantizedRows {
+    int32 num_rows = 0;
+    int32 num_cols = 0;
+    int32 stride = 0;
+    std::vector<int8_t> data;
+    std::vector<float> scales;
+
+    void Quantize(const BaseFloat *m, int32 rows, int32 cols, int32 m_stride);
+    void Quantize(const MatrixBase<BaseFloat> &m) {
+        Quantize(m.Data(), m.NumRows(), m.NumCols(), m.Stride());
+    }
+    const int8_t *Row(int32 r) const { return data.data() + static_cast<size_t>(r) * stride; }
+};
+
+// Weight matrix quantized to int8 for inference. Activations are
+// quantized per frame when the product is computed, the dot products
+// are done in int32 with AVX512-VNNI instructions chosen at runtime, or
+// with the NEON dot product instructions on ARM.
+class QuantizedMatrix {
+    public:
+        void Init(const MatrixBase<BaseFloat> &m);
+
+        // out(r, o) += in(row_offset + r * row_stride) . M(o) for
+        // every row r of out
+        void AddMatMatTrans(const QuantizedRows &in, int32 row_offset, int32 row_stride,
+                            MatrixBase<BaseFloat> *out) const;
+
+    private:
+        QuantizedRows weights_;
+        // Subtracted from the dot products of every output
+        std::vector<int32> offsets_;
+};
+
+// Drop-in replacements of the components used by TDNN-F models. The
+// float parameters are kept so the model can still be written and
+// inspected, only Propagate() is replaced. On GPU the float version is
+// used.
+class QuantizedAffineComponent: public nnet3::AffineComponent {
+    public:
+        explicit QuantizedAffineComponent(const nnet3::AffineComponent &other);
+        virtual nnet3::Component* Copy() const { return new QuantizedAffineComponent(*this); }
+        virtual void* Propagate(const nnet3::ComponentPrecomputedIndexes *indexes,
+                                const CuMatrixBase<BaseFloat> &in,
+                                CuMatrixBase<BaseFloat> *out) const;
+    private:
+        QuantizedMatrix weights_;
+};
+
+class QuantizedLinearComponent: public nnet3::LinearComponent {
+    public:
+        explicit QuantizedLinearComponent(const nnet3::LinearComponent &other);
+        virtual nnet3::Component* Copy() const { return new QuantizedLinearComponent(*this); }
+        virtual void* Propagate(const nnet3::ComponentPrecomputedIndexes *indexes,
+                                const CuMatrixBase<BaseFloat> &in,
+                                CuMatrixBase<BaseFloat> *out) const;
+    private:
+        QuantizedMatrix weights_;
+};
+
+class QuantizedTdnnComponent: public nnet3::TdnnComponent {
+    public:
+        explicit QuantizedTdnnComponent(const nnet3::TdnnComponent &other);
+        virtual nnet3::Component* Copy() const { return new QuantizedTdnnComponent(*this); }
+        virtual void* Propagate(const nnet3::ComponentPrecomputedIndexes *indexes,
+                                const CuMatrixBase<BaseFloat> &in,
+                                CuMatrixBase<BaseFloat> *out) const;
+    private:
+        // One matrix per time offset
+        std::vector<QuantizedMatrix> weights_;
+        Vector<BaseFloat> bias_;
+};
+
+// Replaces the affine, linear and TDNN components of the network with the
+// quantized versions. The output layer stays in float since it affects the
+// accuracy most. Returns the number of replaced components, none when the
+// CPU lacks int8 dot product instructions.
+int32 QuantizeNnet(nnet3::Nnet *nnet);
+
+// Instruction set of the kernels chosen for this CPU, for logging
+const char *QuantizedKernelName();
+
+#endif /* VOSK_QUANTIZED_NNET_H */
@@ -14,9 +14,11 @@
 
 #include "recognizer.h"
 #include "json.h"
+#include "json_writer.h"
+#include "audio_utils.h"
+#include "async_pool.h"
 #include "fstext/fstext-utils.h"
 #include "lat/sausages.h"
-#include "language_model.h"
 
 using namespace fst;
 using namespace kaldi::nnet3;
@@ -25,22 +27,12 @@ Recognizer::Recognizer(Model *model, float sample_frequency) : model_(model), sp
 
     model_->Ref();
 
-    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (model_->feature_info_);
-    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_.silence_weighting_config, 3);
+    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (*model_->feature_info_);
+    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_->silence_weighting_config, 3);
 
-    if (!model_->hclg_fst_) {
-        if (model_->hcl_fst_ && model_->g_fst_) {
-            decode_fst_ = LookaheadComposeFst(*model_->hcl_fst_, *model_->g_fst_, model_->disambig_);
-        } else {
-            KALDI_ERR << "Can't create decoding graph";
-        }
-    }
+    InitGraph();
 
-    decoder_ = new kaldi::SingleUtteranceNnet3Decoder(model_->nnet3_decoding_config_,
-            *model_->trans_model_,
-            *model_->decodable_info_,
-            model_->hclg_fst_ ? *model_->hclg_fst_ : *decode_fst_,
-            feature_pipeline_);
+    decoder_ = NewDecoder();
 
     InitState();
     InitRescoring();
@@ -50,107 +42,74 @@ Recognizer::Recognizer(Model *model, float sample_frequency, char const *grammar
 {
     model_->Ref();
 
-    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (model_->feature_info_);
-    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_.silence_weighting_config, 3);
+    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (*model_->feature_info_);
+    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_->silence_weighting_config, 3);
 
-    if (model_->hcl_fst_) {
-        json::JSON obj;
-        obj = json::JSON::Load(grammar);
+    has_grammar_ = true;
+    grammar_ = grammar;
+    InitGraph();
 
-        if (obj.length() <= 0) {
-            KALDI_WARN << "Expecting array of strings, got: '" << grammar << "'";
-        } else {
-            KALDI_LOG << obj;
+    decoder_ = NewDecoder();
 
-            LanguageModelOptions opts;
+    InitState();
+    InitRescoring();
+}
 
-            opts.ngram_order = 2;
-            opts.discount = 0.5;
+Recognizer::Recognizer(Model *model, float sample_frequency, SpkModel *spk_model) : model_(model), spk_model_(spk_model), sample_frequency_(sample_frequency) {
 
-            LanguageModelEstimator estimator(opts);
-            for (int i = 0; i < obj.length(); i++) {
-                bool ok;
-                string line = obj[i].ToString(ok);
-                if (!ok) {
-                    KALDI_ERR << "Expecting array of strings, got: '" << obj << "'";
-                }
+    model_->Ref();
+    spk_model->Ref();
 
-                std::vector<int32> sentence;
-                stringstream ss(line);
-                string token;
-                while (getline(ss, token, ' ')) {
-                    int32 id = model_->word_syms_->Find(token);
-                    if (id == kNoSymbol) {
-                        KALDI_WARN << "Ignoring word missing in vocabulary: '" << token << "'";
-                    } else {
-                        sentence.push_back(id);
-                    }
-                }
-                estimator.AddCounts(sentence);
-            }
-            g_fst_ = new StdVectorFst();
-            estimator.Estimate(g_fst_);
+    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (*model_->feature_info_);
+    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_->silence_weighting_config, 3);
 
-            decode_fst_ = LookaheadComposeFst(*model_->hcl_fst_, *g_fst_, model_->disambig_);
-        }
-    } else {
-        KALDI_WARN << "Runtime graphs are not supported by this model";
-    }
+    InitGraph();
+
+    decoder_ = NewDecoder();
 
-    decoder_ = new kaldi::SingleUtteranceNnet3Decoder(model_->nnet3_decoding_config_,
-            *model_->trans_model_,
-            *model_->decodable_info_,
-            model_->hclg_fst_ ? *model_->hclg_fst_ : *decode_fst_,
-            feature_pipeline_);
+    spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
+    ResetSpkWindows();
 
     InitState();
     InitRescoring();
 }
 
-Recognizer::Recognizer(Model *model, float sample_frequency, SpkModel *spk_model) : model_(model), spk_model_(spk_model), sample_frequency_(sample_frequency) {
-
-    model_->Ref();
-    spk_model->Ref();
+Recognizer::Recognizer(ModelRegistry *registry, float sample_frequency, char const *grammar) : registry_(registry), spk_model_(0), sample_frequency_(sample_frequency)
+{
+    registry_->Ref();
+    model_ = registry_->Acquire(&model_version_);
 
-    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (model_->feature_info_);
-    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_.silence_weighting_config, 3);
+    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (*model_->feature_info_);
+    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_->silence_weighting_config, 3);
 
-    if (!model_->hclg_fst_) {
-        if (model_->hcl_fst_ && model_->g_fst_) {
-            decode_fst_ = LookaheadComposeFst(*model_->hcl_fst_, *model_->g_fst_, model_->disambig_);
-        } else {
-            KALDI_ERR << "Can't create decoding graph";
-        }
+    if (grammar) {
+        has_grammar_ = true;
+        grammar_ = grammar;
     }
+    InitGraph();
 
-    decoder_ = new kaldi::SingleUtteranceNnet3Decoder(model_->nnet3_decoding_config_,
-            *model_->trans_model_,
-            *model_->decodable_info_,
-            model_->hclg_fst_ ? *model_->hclg_fst_ : *decode_fst_,
-            feature_pipeline_);
-
-    spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
+    decoder_ = NewDecoder();
 
     InitState();
     InitRescoring();
 }
 
 Recognizer::~Recognizer() {
+    WaitAsync();
+    FlushStats();
+
     delete decoder_;
     delete feature_pipeline_;
     delete silence_weighting_;
-    delete g_fst_;
     delete decode_fst_;
     delete spk_feature_;
 
-    delete lm_to_subtract_;
-    delete carpa_to_add_;
-    delete carpa_to_add_scale_;
-    delete rnnlm_info_;
-    delete rnnlm_to_add_;
-    delete rnnlm_to_add_scale_;
+    FreeRescoring();
+    delete hotword_fst_;
 
     model_->Unref();
+    if (registry_)
+         registry_->Unref();
     if (spk_model_)
          spk_model_->Unref();
 }
@@ -164,69 +123,314 @@ void Recognizer::InitState()
     state_ = RECOGNIZER_INITIALIZED;
 }
 
+// Composes the decoding graph when the model has no HCLG, with the
+// grammar of the recognizer if it has one
+void Recognizer::InitGraph()
+{
+    if (has_grammar_) {
+        if (model_->hcl_fst_) {
+            json::JSON obj;
+            obj = json::JSON::Load(grammar_);
+
+            if (obj.length() <= 0) {
+                KALDI_WARN << "Expecting array of strings, got: '" << grammar_ << "'";
+            } else {
+                KALDI_LOG << obj;
+
+                std::vector<std::vector<int32> > sentences;
+                for (int i = 0; i < obj.length(); i++) {
+                    bool ok;
+                    string line = obj[i].ToString(ok);
+                    if (!ok) {
+                        KALDI_ERR << "Expecting array of strings, got: '" << obj << "'";
+                    }
+
+                    std::vector<int32> sentence;
+                    stringstream ss(line);
+                    string token;
+                    while (getline(ss, token, ' ')) {
+                        int32 id = model_->word_syms_->Find(token);
+                        if (id == kNoSymbol) {
+                            KALDI_WARN << "Ignoring word missing in vocabulary: '" << token << "'";
+                        } else {
+                            sentence.push_back(id);
+                        }
+                    }
+                    sentences.push_back(sentence);
+                }
+                g_fst_ = model_->GetGrammarFst(sentences);
+
+                decode_fst_ = LookaheadComposeFst(*model_->hcl_fst_, *g_fst_, model_->disambig_);
+            }
+        } else {
+            KALDI_WARN << "Runtime graphs are not supported by this model";
+        }
+        return;
+    }
+
+    if (!model_->hclg_fst_) {
+        if (model_->hcl_fst_ && model_->g_fst_) {
+            if (model_->lookahead_cache_) {
+                decode_fst_ = new CachedFst(model_->lookahead_cache_);
+            } else {
+                decode_fst_ = LookaheadComposeFst(*model_->hcl_fst_, *model_->g_fst_, model_->disambig_);
+            }
+        } else {
+            KALDI_ERR << "Can't create decoding graph";
+        }
+    }
+}
+
+// The decoder of the current graph and feature pipeline
+OnlineNnet3Decoder *Recognizer::NewDecoder()
+{
+    return new OnlineNnet3Decoder(model_->nnet3_decoding_config_,
+        *model_->trans_model_,
+        *model_->decodable_info_,
+        model_->nnet_batcher_,
+        model_->hclg_fst_ ? *model_->hclg_fst_ : *decode_fst_,
+        feature_pipeline_);
+}
+
 void Recognizer::InitRescoring()
 {
     if (model_->graph_lm_fst_) {
 
-        fst::CacheOptions cache_opts(true, -1);
-        fst::ArcMapFstOptions mapfst_opts(cache_opts);
-        fst::StdToLatticeMapper<BaseFloat> mapper;
-
-        lm_to_subtract_ = new fst::ArcMapFst<fst::StdArc, LatticeArc, fst::StdToLatticeMapper<BaseFloat> >(*model_->graph_lm_fst_, mapper, mapfst_opts);
+        lm_to_subtract_ = new fst::BackoffDeterministicOnDemandFst<fst::StdArc>(*model_->graph_lm_fst_);
+        lm_to_subtract_scale_ = new fst::ScaleDeterministicOnDemandFst(-1.0, lm_to_subtract_);
         carpa_to_add_ = new ConstArpaLmDeterministicFst(model_->const_arpa_);
 
         if (model_->rnnlm_enabled_) {
            int lm_order = 4;
-           rnnlm_info_ = new kaldi::rnnlm::RnnlmComputeStateInfo(model_->rnnlm_compute_opts, model_->rnnlm, model_->word_embedding_mat);
-           rnnlm_to_add_ = new kaldi::rnnlm::KaldiRnnlmDeterministicFst(lm_order, *rnnlm_info_);
+           rnnlm_to_add_ = new SharedRnnlmDeterministicFst(lm_order, model_->rnnlm_cache_);
            rnnlm_to_add_scale_ = new fst::ScaleDeterministicOnDemandFst(0.5, rnnlm_to_add_);
            carpa_to_add_scale_ = new fst::ScaleDeterministicOnDemandFst(-0.5, carpa_to_add_);
         }
     }
 }
 
+void Recognizer::FreeRescoring()
+{
+    delete lm_to_subtract_scale_;
+    delete lm_to_subtract_;
+    delete carpa_to_add_;
+    delete carpa_to_add_scale_;
+    delete rnnlm_to_add_;
+    delete rnnlm_to_add_scale_;
+    lm_to_subtract_scale_ = nullptr;
+    lm_to_subtract_ = nullptr;
+    carpa_to_add_ = nullptr;
+    carpa_to_add_scale_ = nullptr;
+    rnnlm_to_add_ = nullptr;
+    rnnlm_to_add_scale_ = nullptr;
+}
+
+// Moves to the current model of the registry if it was swapped. The
+// decoder is deleted, the graph, rescoring and hotwords are created for
+// the new model, the pipeline is left to the caller. Returns the previous
+// model which is still referenced so that the old pipeline can be deleted
+// safely, or nullptr if the model didn't change.
+Model *Recognizer::SwitchModel()
+{
+    if (registry_->Version() == model_version_) {
+        return nullptr;
+    }
+
+    Model *model = registry_->Acquire(&model_version_);
+    if (model == model_) {
+        model->Unref();
+        return nullptr;
+    }
+
+    // Counters so far belong to the old model
+    FlushStats();
+
+    delete decoder_;
+    decoder_ = nullptr;
+    delete decode_fst_;
+    decode_fst_ = nullptr;
+    g_fst_.reset();
+    FreeRescoring();
+
+    Model *old_model = model_;
+    model_ = model;
+    InitGraph();
+    InitRescoring();
+    if (!hotwords_.empty()) {
+        string hotwords = hotwords_;
+        SetHotwords(hotwords.c_str());
+    }
+    return old_model;
+}
+
+// Decoded frames before the feature pipeline is restarted
+#define MAX_PIPELINE_FRAMES 20000
+// Audio kept to be decoded after the restart, more
+// than the pipeline ever holds undecoded
+#define MAX_TAIL_SECONDS 2.0
+// Speech detection frame, silence after which the audio is skipped
+// and the audio before the speech start decoded after the skip
+#define VAD_FRAME_SECONDS 0.01
+#define VAD_HANGOVER_SECONDS 0.3
+#define VAD_PREROLL_SECONDS 0.2
+
 void Recognizer::CleanUp()
 {
-    delete silence_weighting_;
-    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_.silence_weighting_config, 3);
+    ClearBestPath();
 
     if (decoder_)
        frame_offset_ += decoder_->NumFramesDecoded();
+    vad_speech_fed_ = false;
+    bool restart = decoder_ == nullptr || state_ == RECOGNIZER_FINALIZED;
 
-    // Each 10 minutes we drop the pipeline to save frontend memory in continuous processing
-    // here we drop few frames remaining in the feature pipeline but hope it will not
-    // cause a huge accuracy drop since it happens not very frequently.
+    // New utterances start with the swapped model, the old one is
+    // released once its pipeline is deleted
+    Model *old_model = registry_ ? SwitchModel() : nullptr;
 
-    // Also restart if we retrieved final result already
+    delete silence_weighting_;
+    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_->silence_weighting_config, 3);
 
-    if (decoder_ == nullptr || state_ == RECOGNIZER_FINALIZED || frame_offset_ > 20000) {
+    // Restart if we retrieved final result already
+    if (restart) {
         samples_round_start_ += samples_processed_;
         samples_processed_ = 0;
         frame_offset_ = 0;
+        tail_audio_.clear();
 
         delete decoder_;
         delete feature_pipeline_;
 
-        feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (model_->feature_info_);
-        decoder_ = new kaldi::SingleUtteranceNnet3Decoder(model_->nnet3_decoding_config_,
-            *model_->trans_model_,
-            *model_->decodable_info_,
-            model_->hclg_fst_ ? *model_->hclg_fst_ : *decode_fst_,
-            feature_pipeline_);
+        feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (*model_->feature_info_);
+        decoder_ = NewDecoder();
 
         if (spk_model_) {
             delete spk_feature_;
             spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
+            ResetSpkWindows();
         }
+    } else if (old_model) {
+        // The audio after the endpoint is decoded again with the new model,
+        // the i-vector adaptation only applies to the same acoustic model
+        RestartPipeline(old_model->feature_info_ == model_->feature_info_);
+    } else if (frame_offset_ > MAX_PIPELINE_FRAMES) {
+        RestartPipeline();
     } else {
         decoder_->InitDecoding(frame_offset_);
     }
+
+    if (old_model) {
+        old_model->Unref();
+    }
+}
+
+// Each 10 minutes the pipeline is created again to save frontend memory in
+// continuous processing. The audio which is not decoded yet is fed again,
+// so the restart is not noticeable in the results.
+void Recognizer::RestartPipeline(bool keep_adaptation)
+{
+    int64 decoded_samples = static_cast<int64>(frame_offset_ * 0.03 * sample_frequency_);
+    int64 tail = std::min<int64>(std::max<int64>(samples_processed_ - decoded_samples, 0),
+                                 tail_audio_.size());
+    ResetPipeline(SubVector<BaseFloat>(tail_audio_.data() + tail_audio_.size() - tail, tail),
+                  keep_adaptation);
+}
+
+// Creates the pipeline and the decoder again, they start with the given
+// audio which is the end of the audio received so far. The i-vector
+// adaptation state is carried over unless disabled.
+void Recognizer::ResetPipeline(const VectorBase<BaseFloat> &audio, bool keep_adaptation)
+{
+    OnlineIvectorExtractorAdaptationState adaptation_state(model_->feature_info_->ivector_extractor_info);
+    bool has_ivector = keep_adaptation && feature_pipeline_->IvectorFeature() != nullptr;
+    if (has_ivector) {
+        feature_pipeline_->IvectorFeature()->GetAdaptationState(&adaptation_state);
+    }
+
+    samples_round_start_ += samples_processed_ - audio.Dim();
+    samples_processed_ = audio.Dim();
+    frame_offset_ = 0;
+
+    ClearBestPath();
+    delete decoder_;
+    delete feature_pipeline_;
+    delete silence_weighting_;
+
+    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (*model_->feature_info_);
+    if (has_ivector) {
+        feature_pipeline_->IvectorFeature()->SetAdaptationState(adaptation_state);
+    }
+    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_->silence_weighting_config, 3);
+    decoder_ = NewDecoder();
+
+    if (audio.Dim() > 0) {
+        feature_pipeline_->AcceptWaveform(sample_frequency_, audio);
+    }
+
+    if (spk_model_) {
+        delete spk_feature_;
+        spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
+        ResetSpkWindows();
+        if (audio.Dim() > 0) {
+            spk_feature_->AcceptWaveform(sample_frequency_, audio);
+        }
+    }
+}
+
+// Skips the silence between utterances. Once nothing but silence was fed
+// since the last endpoint and the silence lasts long enough, the audio is
+// not decoded anymore. When speech starts the pipeline is created again
+// with a bit of the audio before the speech, the skipped samples are
+// counted in samples_round_start_ so the timestamps stay right.
+//
+// Checks len samples of wdata at offset, the samples are already in
+// tail_audio_. Returns the number of leading samples to skip.
+int Recognizer::GateSilence(const VectorBase<BaseFloat> &wdata, int offset, int len)
+{
+    int frame = std::max(1, static_cast<int>(sample_frequency_ * VAD_FRAME_SECONDS));
+    int64 hangover = static_cast<int64>(sample_frequency_ * VAD_HANGOVER_SECONDS);
+    int skip = 0;
+
+    for (int i = 0; i < len; i += frame) {
+        int n = std::min(frame, len - i);
+        bool speech = vad_detector_.IsSpeech(wdata.Data() + offset + i, n);
+        vad_silence_samples_ = speech ? 0 : vad_silence_samples_ + n;
+
+        if (vad_gated_ && speech) {
+            vad_gated_ = false;
+            skip = i;
+            samples_processed_ += skip;
+            int64 preroll = std::min<int64>(static_cast<int64>(sample_frequency_ * VAD_PREROLL_SECONDS),
+                                            samples_processed_);
+            if (offset + i >= preroll) {
+                ResetPipeline(wdata.Range(offset + i - preroll, preroll));
+            } else {
+                // Starts in the previous call, take it from the tail
+                int64 end = static_cast<int64>(tail_audio_.size()) - (wdata.Dim() - offset - i);
+                preroll = std::min<int64>(preroll, std::max<int64>(end, 0));
+                ResetPipeline(SubVector<BaseFloat>(tail_audio_.data() + end - preroll, preroll));
+            }
+        }
+        if (!vad_gated_ && speech) {
+            vad_speech_fed_ = true;
+        }
+    }
+
+    if (vad_gated_) {
+        skip = len;
+        samples_processed_ += skip;
+    } else if (!vad_speech_fed_ && vad_silence_samples_ >= hangover) {
+        // Starts with the next step, this one is already decoded
+        vad_gated_ = true;
+    }
+    pending_stats_.skipped_seconds += skip / sample_frequency_;
+    return skip;
 }
 
 void Recognizer::UpdateSilenceWeights()
 {
     if (silence_weighting_->Active() && feature_pipeline_->NumFramesReady() > 0 &&
         feature_pipeline_->IvectorFeature() != nullptr) {
+        StatsTimer timer(TimeCounter(pending_stats_.silence_weights));
         vector<pair<int32, BaseFloat> > delta_weights;
         silence_weighting_->ComputeCurrentTraceback(decoder_->Decoder());
         silence_weighting_->GetDeltaWeights(feature_pipeline_->NumFramesReady(),
@@ -246,6 +450,113 @@ void Recognizer::SetWords(bool words)
     words_ = words;
 }
 
+void Recognizer::SetChunkSize(float chunk_size)
+{
+    if (chunk_size <= 0) {
+        KALDI_WARN << "Ignoring invalid chunk size " << chunk_size;
+        return;
+    }
+    chunk_size_ = chunk_size;
+}
+
+void Recognizer::SetSilenceWeightInterval(float interval)
+{
+    silence_weight_interval_ = std::max(interval, 0.0f);
+}
+
+void Recognizer::SetSpkWindow(float window, float shift)
+{
+    if (window < 0 || (window > 0 && shift <= 0)) {
+        KALDI_WARN << "Ignoring invalid speaker window " << window << " with shift " << shift;
+        return;
+    }
+    spk_window_ = window;
+    spk_window_shift_ = shift;
+}
+
+void Recognizer::SetVad(bool vad)
+{
+    vad_ = vad;
+}
+
+// Boost of the phrases given without one
+#define HOTWORD_DEFAULT_BOOST 4.0
+
+void Recognizer::SetHotwords(const char *hotwords)
+{
+    delete hotword_fst_;
+    hotword_fst_ = nullptr;
+    hotwords_ = hotwords ? hotwords : "";
+    if (hotwords_.empty())
+        return;
+
+    json::JSON obj = json::JSON::Load(hotwords);
+    if (obj.JSONType() != json::JSON::Class::Array) {
+        KALDI_WARN << "Expecting array of phrases, got: '" << hotwords << "'";
+        return;
+    }
+
+    HotwordFst *fst = new HotwordFst();
+    for (int i = 0; i < obj.length(); i++) {
+        json::JSON &item = obj[i];
+        string phrase;
+        double boost = HOTWORD_DEFAULT_BOOST;
+        bool ok;
+        if (item.JSONType() == json::JSON::Class::String) {
+            phrase = item.ToString();
+        } else if (item.JSONType() == json::JSON::Class::Object && item.hasKey("phrase")) {
+            phrase = item["phrase"].ToString();
+            if (item.hasKey("boost")) {
+                boost = item["boost"].ToFloat(ok);
+                if (!ok)
+                    boost = item["boost"].ToInt();
+            }
+        } else {
+            KALDI_WARN << "Ignoring invalid hotword: '" << item << "'";
+            continue;
+        }
+
+        std::vector<int32> words;
+        stringstream ss(phrase);
+        string token;
+        bool missing = false;
+        while (ss >> token) {
+            int32 id = model_->word_syms_->Find(token);
+            if (id == kNoSymbol) {
+                KALDI_WARN << "Ignoring hotword with word missing in vocabulary: '" << token << "'";
+                missing = true;
+                break;
+            }
+            words.push_back(id);
+        }
+        if (!missing) {
+            fst->AddPhrase(words, boost);
+        }
+    }
+    fst->Finish();
+
+    if (fst->Empty()) {
+        delete fst;
+    } else {
+        hotword_fst_ = fst;
+    }
+}
+
+void Recognizer::SetIncrementalPartial(bool incremental)
+{
+    incremental_partial_ = incremental;
+}
+
+void Recognizer::SetRescoringPruning(float beam, int max_arcs)
+{
+    if (beam <= 0 || max_arcs <= 0) {
+        KALDI_WARN << "Ignoring invalid rescoring pruning beam " << beam << " with max arcs " << max_arcs;
+        return;
+    }
+    rescore_beam_ = beam;
+    rescore_max_arcs_ = max_arcs;
+}
+
 void Recognizer::SetSpkModel(SpkModel *spk_model)
 {
     if (state_ == RECOGNIZER_RUNNING) {
@@ -254,37 +565,41 @@ void Recognizer::SetSpkModel(SpkModel *spk_model)
     }
     spk_model_ = spk_model;
     spk_model_->Ref();
+    delete spk_feature_;
     spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
+    ResetSpkWindows();
 }
 
 bool Recognizer::AcceptWaveform(const char *data, int len)
 {
-    Vector<BaseFloat> wave;
-    wave.Resize(len / 2, kUndefined);
-    for (int i = 0; i < len / 2; i++)
-        wave(i) = *(((short *)data) + i);
-    return AcceptWaveform(wave);
+    return AcceptWaveform((const short *)data, len / 2);
 }
 
 bool Recognizer::AcceptWaveform(const short *sdata, int len)
 {
-    Vector<BaseFloat> wave;
-    wave.Resize(len, kUndefined);
-    for (int i = 0; i < len; i++)
-        wave(i) = sdata[i];
-    return AcceptWaveform(wave);
+    // The buffer is reused between calls and grows to the largest chunk
+    if (wave_buffer_.size() < (size_t)len) {
+        wave_buffer_.resize(len);
+    }
+    ConvertSamples(sdata, wave_buffer_.data(), len);
+    return AcceptWaveform(SubVector<BaseFloat>(wave_buffer_.data(), len));
 }
 
 bool Recognizer::AcceptWaveform(const float *fdata, int len)
 {
-    Vector<BaseFloat> wave;
-    wave.Resize(len, kUndefined);
-    for (int i = 0; i < len; i++)
-        wave(i) = fdata[i];
-    return AcceptWaveform(wave);
+#if KALDI_DOUBLEPRECISION
+    if (wave_buffer_.size() < (size_t)len) {
+        wave_buffer_.resize(len);
+    }
+    std::copy(fdata, fdata + len, wave_buffer_.begin());
+    return AcceptWaveform(SubVector<BaseFloat>(wave_buffer_.data(), len));
+#else
+    // Samples are only read by the pipeline, no need to copy them
+    return AcceptWaveform(SubVector<BaseFloat>(const_cast<float *>(fdata), len));
+#endif
 }
 
-bool Recognizer::AcceptWaveform(Vector<BaseFloat> &wdata)
+bool Recognizer::AcceptWaveform(const VectorBase<BaseFloat> &wdata)
 {
     // Cleanup if we finalized previous utterance or the whole feature pipeline
     if (!(state_ == RECOGNIZER_RUNNING || state_ == RECOGNIZER_INITIALIZED)) {
@@ -292,17 +607,61 @@ bool Recognizer::AcceptWaveform(Vector<BaseFloat> &wdata)
     }
     state_ = RECOGNIZER_RUNNING;
 
-    int step = static_cast<int>(sample_frequency_ * 0.2);
+    // Keep the recent audio only when the pipeline may be restarted with
+    // it: for the speech start after skipped silence, for a swapped model
+    // or when the long-session restart is near. The restart comes after
+    // at least MAX_TAIL_SECONDS more audio is decoded, so the tail is full.
+    bool keep_tail = vad_ || registry_ ||
+        frame_offset_ + decoder_->NumFramesDecoded() >= MAX_PIPELINE_FRAMES - MAX_TAIL_SECONDS / 0.03;
+    if (keep_tail) {
+        size_t max_tail = static_cast<size_t>(sample_frequency_ * MAX_TAIL_SECONDS);
+        if ((size_t)wdata.Dim() >= max_tail) {
+            tail_audio_.assign(wdata.Data() + wdata.Dim() - max_tail, wdata.Data() + wdata.Dim());
+        } else {
+            tail_audio_.insert(tail_audio_.end(), wdata.Data(), wdata.Data() + wdata.Dim());
+            if (tail_audio_.size() > 2 * max_tail) {
+                tail_audio_.erase(tail_audio_.begin(), tail_audio_.end() - max_tail);
+            }
+        }
+    } else if (!tail_audio_.empty()) {
+        // Older audio must not precede the tail kept later
+        tail_audio_.clear();
+    }
+
+    int step = std::max(1, static_cast<int>(sample_frequency_ * chunk_size_));
+    int64 silence_update_samples = static_cast<int64>(sample_frequency_ * silence_weight_interval_);
     for (int i = 0; i < wdata.Dim(); i+= step) {
-        SubVector<BaseFloat> r = wdata.Range(i, std::min(step, wdata.Dim() - i));
-        feature_pipeline_->AcceptWaveform(sample_frequency_, r);
-        UpdateSilenceWeights();
-        decoder_->AdvanceDecoding();
+        int len = std::min(step, wdata.Dim() - i);
+        // The decoder may be created again when the speech starts
+        int skip = vad_ ? GateSilence(wdata, i, len) : 0;
+        if (skip == len) {
+            continue;
+        }
+        SubVector<BaseFloat> r = wdata.Range(i + skip, len - skip);
+        {
+            StatsTimer timer(TimeCounter(pending_stats_.features));
+            feature_pipeline_->AcceptWaveform(sample_frequency_, r);
+            if (spk_feature_) {
+                spk_feature_->AcceptWaveform(sample_frequency_, r);
+            }
+        }
+        samples_processed_ += r.Dim();
+        samples_since_silence_update_ += r.Dim();
+        if (samples_since_silence_update_ >= silence_update_samples) {
+            UpdateSilenceWeights();
+            samples_since_silence_update_ = 0;
+        }
+        {
+            StatsTimer timer(TimeCounter(pending_stats_.decode));
+            int32 num_frames_decoded = decoder_->NumFramesDecoded();
+            decoder_->AdvanceDecoding();
+            pending_stats_.frames_decoded += decoder_->NumFramesDecoded() - num_frames_decoded;
+        }
     }
-    samples_processed_ += wdata.Dim();
+    pending_stats_.audio_seconds += wdata.Dim() / sample_frequency_;
 
-    if (spk_feature_) {
-        spk_feature_->AcceptWaveform(sample_frequency_, wdata);
+    if (spk_feature_ && spk_window_ > 0) {
+        UpdateSpkWindows(false);
     }
 
     if (decoder_->EndpointDetected(model_->endpoint_config_)) {
@@ -314,9 +673,9 @@ bool Recognizer::AcceptWaveform(Vector<BaseFloat> &wdata)
 
 // Computes an xvector from a chunk of speech features.
 static void RunNnetComputation(const MatrixBase<BaseFloat> &features,
-    const nnet3::Nnet &nnet, nnet3::CachingOptimizingCompiler *compiler,
-    Vector<BaseFloat> *xvector) 
+    SpkModel *spk_model, Vector<BaseFloat> *xvector)
 {
+    const nnet3::Nnet &nnet = spk_model->speaker_nnet;
     nnet3::ComputationRequest request;
     request.need_model_derivative = false;
     request.store_component_stats = false;
@@ -328,7 +687,11 @@ static void RunNnetComputation(const MatrixBase<BaseFloat> &features,
     output_spec.indexes.resize(1);
     request.outputs.resize(1);
     request.outputs[0].Swap(&output_spec);
-    shared_ptr<const nnet3::NnetComputation> computation = compiler->Compile(request);
+    shared_ptr<const nnet3::NnetComputation> computation;
+    {
+        std::lock_guard<std::mutex> lock(spk_model->compiler_mutex);
+        computation = spk_model->compiler->Compile(request);
+    }
     nnet3::Nnet *nnet_to_update = nullptr;  // we're not doing any update.
     nnet3::NnetComputer computer(nnet3::NnetComputeOptions(), *computation,
                     nnet, nnet_to_update);
@@ -343,6 +706,120 @@ static void RunNnetComputation(const MatrixBase<BaseFloat> &features,
 
 #define MIN_SPK_FEATS 50
 
+void Recognizer::CopySpkFeatures()
+{
+    // Copy only the frames computed since the previous call, the buffer
+    // grows geometrically to keep the copying linear in the utterance length
+    int num_ready = spk_feature_->NumFramesReady();
+    if (num_ready > spk_feats_.NumRows()) {
+        spk_feats_.Resize(std::max(num_ready, 2 * spk_feats_.NumRows()),
+                          spk_feature_->Dim(), kCopyData);
+    }
+    for (; spk_frames_copied_ < num_ready; spk_frames_copied_++) {
+        SubVector<BaseFloat> row(spk_feats_, spk_frames_copied_);
+        spk_feature_->GetFrame(spk_frames_copied_, &row);
+    }
+}
+
+// Applies CMN, runs the extractor and whitens the vector
+void Recognizer::ComputeSpkVector(const MatrixBase<BaseFloat> &mfcc, Vector<BaseFloat> *out_xvector)
+{
+    SlidingWindowCmnOptions cmvn_opts;
+    cmvn_opts.center = true;
+    cmvn_opts.cmn_window = 300;
+    Matrix<BaseFloat> features(mfcc.NumRows(), mfcc.NumCols(), kUndefined);
+    SlidingWindowCmn(cmvn_opts, mfcc, &features);
+
+    Vector<BaseFloat> xvector;
+    RunNnetComputation(features, spk_model_, &xvector);
+
+    // Whiten the vector with global mean and transform and normalize mean
+    xvector.AddVec(-1.0, spk_model_->mean);
+
+    out_xvector->Resize(spk_model_->transform.NumRows(), kSetZero);
+    out_xvector->AddMatVec(1.0, spk_model_->transform, kNoTrans, xvector, 0.0);
+
+    BaseFloat norm = out_xvector->Norm(2.0);
+    BaseFloat ratio = norm / sqrt(out_xvector->Dim()); // how much larger it is
+                                                  // than it would be, in
+                                                  // expectation, if normally
+    out_xvector->Scale(1.0 / ratio);
+}
+
+// Computes vectors of all windows that are complete, every frame is copied
+// and every window is computed once, so the cost is linear in the audio
+// length. When the input is finished the remaining frames form the last
+// window if there are enough of them.
+void Recognizer::UpdateSpkWindows(bool finished)
+{
+    StatsTimer timer(TimeCounter(pending_stats_.speaker));
+    CopySpkFeatures();
+
+    BaseFloat frame_shift = spk_model_->spkvector_mfcc_opts.frame_opts.frame_shift_ms / 1000.0;
+    int32 window_frames = std::max<int32>(spk_window_ / frame_shift, MIN_SPK_FEATS);
+    int32 shift_frames = std::max<int32>(spk_window_shift_ / frame_shift, 1);
+
+    while (spk_window_start_ < spk_frames_copied_) {
+        int32 num_frames = std::min(window_frames, spk_frames_copied_ - spk_window_start_);
+        if (num_frames < window_frames && (!finished || num_frames < MIN_SPK_FEATS))
+            break;
+
+        SpkWindow window;
+        window.start = samples_round_start_ / sample_frequency_ + spk_window_start_ * frame_shift;
+        window.end = window.start + num_frames * frame_shift;
+        SubMatrix<BaseFloat> mfcc(spk_feats_, spk_window_start_, num_frames, 0, spk_feats_.NumCols());
+        ComputeSpkVector(mfcc, &window.xvector);
+        spk_windows_.push_back(window);
+
+        if (num_frames < window_frames)
+            break;
+        spk_window_start_ += shift_frames;
+    }
+    if (finished)
+        spk_window_start_ = spk_frames_copied_;
+}
+
+void Recognizer::ResetSpkWindows()
+{
+    spk_frames_copied_ = 0;
+    spk_window_start_ = 0;
+    spk_windows_.clear();
+}
+
+void Recognizer::AddSpkWindows(json::JSONWriter &writer)
+{
+    if (spk_windows_.empty()) {
+        return;
+    }
+
+    writer.Key("spk_windows");
+    writer.BeginArray();
+    for (const SpkWindow &window : spk_windows_) {
+        writer.BeginObject();
+        writer.Member("end", window.end);
+        writer.Key("spk");
+        writer.BeginArray();
+        for (int i = 0; i < window.xvector.Dim(); i++) {
+            writer.Value(window.xvector(i));
+        }
+        writer.EndArray();
+        writer.Member("start", window.start);
+        writer.EndObject();
+
+        ResultSpkWindow result_window;
+        result_window.start = window.start;
+        result_window.end = window.end;
+        result_window.offset = result_spk_window_values_.size();
+        result_window.dim = window.xvector.Dim();
+        for (int i = 0; i < window.xvector.Dim(); i++) {
+            result_spk_window_values_.push_back(window.xvector(i));
+        }
+        result_spk_windows_.push_back(result_window);
+    }
+    writer.EndArray();
+    spk_windows_.clear();
+}
+
 bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frames)
 {
     vector<int32> nonsilence_frames;
@@ -353,22 +830,22 @@ bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frame
                                           &nonsilence_frames);
     }
 
-    int num_frames = spk_feature_->NumFramesReady() - frame_offset_ * 3;
-    Matrix<BaseFloat> mfcc(num_frames, spk_feature_->Dim());
+    CopySpkFeatures();
+    int num_ready = spk_frames_copied_;
 
-    // Not very efficient, would be nice to have faster search
-    int num_nonsilence_frames = 0;
-    Vector<BaseFloat> feat(spk_feature_->Dim());
+    // Nonsilence frames are sorted decoder frames, every one of
+    // them covers 3 feature frames
+    int num_frames = num_ready - frame_offset_ * 3;
+    vector<bool> nonsilence((num_frames + 2) / 3, false);
+    for (int32 f : nonsilence_frames) {
+        if (f >= 0 && f < (int32)nonsilence.size())
+            nonsilence[f] = true;
+    }
 
+    int num_nonsilence_frames = 0;
     for (int i = 0; i < num_frames; ++i) {
-       if (std::find(nonsilence_frames.begin(),
-                     nonsilence_frames.end(), i / 3) == nonsilence_frames.end()) {
-           continue;
-       }
-
-       spk_feature_->GetFrame(i + frame_offset_ * 3, &feat);
-       mfcc.CopyRowFromVec(feat, num_nonsilence_frames);
-       num_nonsilence_frames++;
+        if (nonsilence[i / 3])
+            num_nonsilence_frames++;
     }
 
     *num_spk_frames = num_nonsilence_frames;
@@ -378,32 +855,13 @@ bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frame
         return false;
     }
 
-    mfcc.Resize(num_nonsilence_frames, spk_feature_->Dim(), kCopyData);
-
-    SlidingWindowCmnOptions cmvn_opts;
-    cmvn_opts.center = true;
-    cmvn_opts.cmn_window = 300;
-    Matrix<BaseFloat> features(mfcc.NumRows(), mfcc.NumCols(), kUndefined);
-    SlidingWindowCmn(cmvn_opts, mfcc, &features);
-
-    nnet3::NnetSimpleComputationOptions opts;
-    nnet3::CachingOptimizingCompilerOptions compiler_config;
-    nnet3::CachingOptimizingCompiler compiler(spk_model_->speaker_nnet, opts.optimize_config, compiler_config);
-
-    Vector<BaseFloat> xvector;
-    RunNnetComputation(features, spk_model_->speaker_nnet, &compiler, &xvector);
-
-    // Whiten the vector with global mean and transform and normalize mean
-    xvector.AddVec(-1.0, spk_model_->mean);
-
-    out_xvector.Resize(spk_model_->transform.NumRows(), kSetZero);
-    out_xvector.AddMatVec(1.0, spk_model_->transform, kNoTrans, xvector, 0.0);
+    Matrix<BaseFloat> mfcc(num_nonsilence_frames, spk_feature_->Dim(), kUndefined);
+    for (int i = 0, j = 0; i < num_frames; ++i) {
+        if (nonsilence[i / 3])
+            mfcc.CopyRowFromVec(spk_feats_.Row(i + frame_offset_ * 3), j++);
+    }
 
-    BaseFloat norm = out_xvector.Norm(2.0);
-    BaseFloat ratio = norm / sqrt(out_xvector.Dim()); // how much larger it is
-                                                  // than it would be, in
-                                                  // expectation, if normally
-    out_xvector.Scale(1.0 / ratio);
+    ComputeSpkVector(mfcc, &out_xvector);
 
     return true;
 }
@@ -411,6 +869,8 @@ bool Recognizer::GetSpkVector(Vector<BaseFloat> &out_xvector, int *num_spk_frame
 
 const char *Recognizer::MbrResult(CompactLattice &rlat)
 {
+    Timer timer;
+
     CompactLattice aligned_lat;
     if (model_->winfo_) {
         WordAlignLattice(rlat, *model_->trans_model_, *model_->winfo_, 0, &aligned_lat);
@@ -425,163 +885,243 @@ const char *Recognizer::MbrResult(CompactLattice &rlat)
           mbr.GetOneBestTimes();
 
     int size = words.size();
-
-    json::JSON obj;
-    stringstream text;
-
-    // Create JSON object
+    double mbr_time = timer.Elapsed();
+    double spk_time = 0;
+
+    // Results are written straight into last_result_, keys in the
+    // order JSON::dump() sorts them
+    string text;
+    ClearResultData();
+    AddResultAlternative(0.0);
+    json::JSONWriter writer(last_result_);
+    writer.BeginObject();
+    if (words_ && size > 0) {
+        writer.Key("result");
+        writer.BeginArray();
+    }
     for (int i = 0; i < size; i++) {
-        json::JSON word;
+        const string &word = model_->word_syms_->Find(words[i]);
+        AddResultWord(words[i], word,
+                      samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].first) * 0.03,
+                      samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].second) * 0.03,
+                      conf[i]);
 
         if (words_) {
-            word["word"] = model_->word_syms_->Find(words[i]);
-            word["start"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].first) * 0.03;
-            word["end"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].second) * 0.03;
-            word["conf"] = conf[i];
-            obj["result"].append(word);
+            writer.BeginObject();
+            writer.Member("conf", conf[i]);
+            writer.Member("end", samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].second) * 0.03);
+            writer.Member("start", samples_round_start_ / sample_frequency_ + (frame_offset_ + times[i].first) * 0.03);
+            writer.Member("word", word);
+            writer.EndObject();
         }
 
         if (i) {
-            text << " ";
+            text += " ";
         }
-        text << model_->word_syms_->Find(words[i]);
+        text += word;
+    }
+    if (words_ && size > 0) {
+        writer.EndArray();
     }
-    obj["text"] = text.str();
 
     if (spk_model_) {
+        Timer spk_timer;
         Vector<BaseFloat> xvector;
         int num_spk_frames;
-        if (GetSpkVector(xvector, &num_spk_frames)) {
+        bool has_xvector = GetSpkVector(xvector, &num_spk_frames);
+        spk_time = spk_timer.Elapsed();
+        if (has_xvector) {
+            writer.Key("spk");
+            writer.BeginArray();
             for (int i = 0; i < xvector.Dim(); i++) {
-                obj["spk"].append(xvector(i));
+                writer.Value(xvector(i));
             }
-            obj["spk_frames"] = num_spk_frames;
+            writer.EndArray();
+            writer.Member("spk_frames", num_spk_frames);
+
+            result_spk_.assign(xvector.Data(), xvector.Data() + xvector.Dim());
+            result_spk_frames_ = num_spk_frames;
         }
+        AddSpkWindows(writer);
     }
 
-    return StoreReturn(obj.dump());
-}
-
-static bool CompactLatticeToWordAlignmentWeight(const CompactLattice &clat,
-                                                std::vector<int32> *words,
-                                                std::vector<int32> *begin_times,
-                                                std::vector<int32> *lengths,
-                                                CompactLattice::Weight *tot_weight_out)
-{
-  typedef CompactLattice::Arc Arc;
-  typedef Arc::Label Label;
-  typedef CompactLattice::StateId StateId;
-  typedef CompactLattice::Weight Weight;
-  using namespace fst;
-
-  words->clear();
-  begin_times->clear();
-  lengths->clear();
-  *tot_weight_out = Weight::Zero();
+    writer.Member("text", text);
+    writer.EndObject();
 
-  StateId state = clat.Start();
-  Weight tot_weight = Weight::One();
+    SetResultText(text);
+    FinishResultData();
 
-  int32 cur_time = 0;
-  if (state == kNoStateId) {
-    KALDI_WARN << "Empty lattice.";
-    return false;
-  }
-  while (1) {
-    Weight final = clat.Final(state);
-    size_t num_arcs = clat.NumArcs(state);
-    if (final != Weight::Zero()) {
-      if (num_arcs != 0) {
-        KALDI_WARN << "Lattice is not linear.";
-        return false;
-      }
-      if (!final.String().empty()) {
-        KALDI_WARN << "Lattice has alignments on final-weight: probably "
-            "was not word-aligned (alignments will be approximate)";
-      }
-      tot_weight = Times(final, tot_weight);
-      *tot_weight_out = tot_weight;
-      return true;
-    } else {
-      if (num_arcs != 1) {
-        KALDI_WARN << "Lattice is not linear: num-arcs = " << num_arcs;
-        return false;
-      }
-      fst::ArcIterator<CompactLattice> aiter(clat, state);
-      const Arc &arc = aiter.Value();
-      Label word_id = arc.ilabel; // Note: ilabel==olabel, since acceptor.
-      // Also note: word_id may be zero; we output it anyway.
-      int32 length = arc.weight.String().size();
-      words->push_back(word_id);
-      begin_times->push_back(cur_time);
-      lengths->push_back(length);
-      tot_weight = Times(arc.weight, tot_weight);
-      cur_time += length;
-      state = arc.nextstate;
+    if (collect_stats_) {
+        pending_stats_.mbr += mbr_time;
+        pending_stats_.speaker += spk_time;
+        pending_stats_.serialization += timer.Elapsed() - mbr_time - spk_time;
     }
-  }
+    return last_result_.c_str();
 }
 
+static inline double LatticeCost(const CompactLatticeWeight &weight)
+{
+    return weight.Weight().Value1() + weight.Weight().Value2();
+}
 
-const char *Recognizer::NbestResult(CompactLattice &clat)
+// Finds the n best paths of a topologically sorted lattice without
+// expanding it. For every state, in reverse topological order, the best
+// suffixes to a final state are kept, each of them is an arc and the rank
+// of the suffix of the next state. The paths are then followed from the
+// start state.
+static void CompactLatticeNbest(const CompactLattice &clat, int32 n,
+                                std::vector<std::vector<CompactLatticeArc> > *paths,
+                                std::vector<double> *costs)
 {
-    Lattice lat;
-    Lattice nbest_lat;
-    std::vector<Lattice> nbest_lats;
+    typedef CompactLattice::StateId StateId;
 
-    ConvertLattice (clat, &lat);
-    fst::ShortestPath(lat, &nbest_lat, max_alternatives_);
-    fst::ConvertNbestToVector(nbest_lat, &nbest_lats);
+    struct Suffix {
+        double cost;
+        int32 arc;  // -1 for the final weight
+        int32 next; // Rank of the suffix of the next state
+    };
 
-    json::JSON obj;
-    std::stringstream ss;
-    for (int k = 0; k < nbest_lats.size(); k++) {
+    paths->clear();
+    costs->clear();
+    if (clat.Start() == fst::kNoStateId || n <= 0) {
+        return;
+    }
 
-      Lattice nlat = nbest_lats[k];
+    std::vector<std::vector<Suffix> > best(clat.NumStates());
+    for (StateId s = clat.NumStates() - 1; s >= 0; s--) {
+        std::vector<Suffix> &suffixes = best[s];
+        CompactLatticeWeight final = clat.Final(s);
+        if (final != CompactLatticeWeight::Zero()) {
+            suffixes.push_back({LatticeCost(final), -1, 0});
+        }
+        int32 a = 0;
+        for (fst::ArcIterator<CompactLattice> aiter(clat, s); !aiter.Done(); aiter.Next(), a++) {
+            const CompactLatticeArc &arc = aiter.Value();
+            double cost = LatticeCost(arc.weight);
+            const std::vector<Suffix> &next = best[arc.nextstate];
+            for (int32 r = 0; r < (int32)next.size(); r++) {
+                suffixes.push_back({cost + next[r].cost, a, r});
+            }
+        }
+        auto less = [](const Suffix &a, const Suffix &b) { return a.cost < b.cost; };
+        if ((int32)suffixes.size() > n) {
+            std::partial_sort(suffixes.begin(), suffixes.begin() + n, suffixes.end(), less);
+            suffixes.resize(n);
+        } else {
+            std::sort(suffixes.begin(), suffixes.end(), less);
+        }
+    }
 
-      CompactLattice nclat;
-      fst::Invert(&nlat);
-      DeterminizeLattice(nlat, &nclat);
+    const std::vector<Suffix> &start = best[clat.Start()];
+    for (int32 r = 0; r < (int32)start.size(); r++) {
+        std::vector<CompactLatticeArc> path;
+        StateId s = clat.Start();
+        int32 rank = r;
+        while (best[s][rank].arc >= 0) {
+            const Suffix &suffix = best[s][rank];
+            fst::ArcIterator<CompactLattice> aiter(clat, s);
+            aiter.Seek(suffix.arc);
+            path.push_back(aiter.Value());
+            s = aiter.Value().nextstate;
+            rank = suffix.next;
+        }
+        paths->push_back(path);
+        costs->push_back(start[r].cost);
+    }
+}
 
-      CompactLattice aligned_nclat;
-      if (model_->winfo_) {
-          WordAlignLattice(nclat, *model_->trans_model_, *model_->winfo_, 0, &aligned_nclat);
-      } else {
-          aligned_nclat = nclat;
-      }
+const char *Recognizer::NbestResult(CompactLattice &clat)
+{
+    Timer timer;
 
-      std::vector<int32> words;
-      std::vector<int32> begin_times;
-      std::vector<int32> lengths;
-      CompactLattice::Weight weight;
+    // Word alignment is only needed for the word times, so it is done once
+    // for the whole lattice and skipped for text-only alternatives
+    CompactLattice aligned_lat;
+    if (model_->winfo_ && words_) {
+        WordAlignLattice(clat, *model_->trans_model_, *model_->winfo_, 0, &aligned_lat);
+    } else {
+        aligned_lat = clat;
+    }
+    TopSortCompactLatticeIfNeeded(&aligned_lat);
 
-      CompactLatticeToWordAlignmentWeight(aligned_nclat, &words, &begin_times, &lengths, &weight);
-      float likelihood = -(weight.Weight().Value1() + weight.Weight().Value2());
+    std::vector<std::vector<CompactLatticeArc> > paths;
+    std::vector<double> costs;
+    CompactLatticeNbest(aligned_lat, max_alternatives_, &paths, &costs);
+    double search_time = timer.Elapsed();
 
-      stringstream text;
-      json::JSON entry;
+    ClearResultData();
 
-      for (int i = 0; i < words.size(); i++) {
-        json::JSON word;
-        if (words[i] == 0)
+    // An empty object is printed as null by JSON::dump()
+    if (paths.empty() && spk_windows_.empty()) {
+        return StoreReturn("null");
+    }
+
+    json::JSONWriter writer(last_result_);
+    writer.BeginObject();
+    if (!paths.empty()) {
+        writer.Key("alternatives");
+        writer.BeginArray();
+    }
+    for (size_t k = 0; k < paths.size(); k++) {
+      float likelihood = -costs[k];
+      string text;
+      bool has_result = false;
+
+      AddResultAlternative(likelihood);
+      writer.BeginObject();
+      writer.Member("confidence", likelihood);
+      int32 begin_time = 0;
+      for (const CompactLatticeArc &arc : paths[k]) {
+        int32 length = arc.weight.String().size();
+        int32 word_id = arc.ilabel;
+        int32 start_time = begin_time;
+        begin_time += length;
+        if (word_id == 0)
             continue;
+
+        const string &word = model_->word_syms_->Find(word_id);
+        double start = samples_round_start_ / sample_frequency_ + (frame_offset_ + start_time) * 0.03;
+        double end = samples_round_start_ / sample_frequency_ + (frame_offset_ + start_time + length) * 0.03;
+        AddResultWord(word_id, word, start, end, 0.0);
         if (words_) {
-            word["word"] = model_->word_syms_->Find(words[i]);
-            word["start"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + begin_times[i]) * 0.03;
-            word["end"] = samples_round_start_ / sample_frequency_ + (frame_offset_ + begin_times[i] + lengths[i]) * 0.03;
-            entry["result"].append(word);
-        }
-        if (i)
-          text << " ";
-        text << model_->word_syms_->Find(words[i]);
+            if (!has_result) {
+                writer.Key("result");
+                writer.BeginArray();
+                has_result = true;
+            }
+            writer.BeginObject();
+            writer.Member("end", end);
+            writer.Member("start", start);
+            writer.Member("word", word);
+            writer.EndObject();
+        }
+        if (!text.empty())
+          text += " ";
+        text += word;
       }
+      if (has_result) {
+          writer.EndArray();
+      }
+      writer.Member("text", text);
+      writer.EndObject();
+      SetResultText(text);
+    }
+    if (!paths.empty()) {
+        writer.EndArray();
+    }
 
-      entry["text"] = text.str();
-      entry["confidence"]= likelihood;
-      obj["alternatives"].append(entry);
+    if (spk_model_) {
+        AddSpkWindows(writer);
     }
 
-    return StoreReturn(obj.dump());
+    writer.EndObject();
+    FinishResultData();
+
+    if (collect_stats_) {
+        pending_stats_.mbr += search_time;
+        pending_stats_.serialization += timer.Elapsed() - search_time;
+    }
+    return last_result_.c_str();
 }
 
 const char* Recognizer::GetResult()
@@ -590,36 +1130,42 @@ const char* Recognizer::GetResult()
         return StoreEmptyReturn();
     }
 
-    // Original from decoder, subtracted graph weight, rescored with carpa, rescored with rnnlm
-    CompactLattice clat, slat, tlat, rlat;
-
-    decoder_->GetLattice(true, &clat);
-
-    if (lm_to_subtract_ && carpa_to_add_) {
-        Lattice lat, composed_lat;
-
-        // Delete old score
-        ConvertLattice(clat, &lat);
-        fst::ScaleLattice(fst::GraphLatticeScale(-1.0), &lat);
-        fst::Compose(lat, *lm_to_subtract_, &composed_lat);
-        fst::Invert(&composed_lat);
-        DeterminizeLattice(composed_lat, &slat);
-        fst::ScaleLattice(fst::GraphLatticeScale(-1.0), &slat);
+    // Original from decoder, rescored with carpa, rescored with rnnlm
+    CompactLattice clat, tlat, rlat;
+
+    // Same as decoder_->GetLattice(), the raw lattice size goes to the stats
+    Timer timer;
+    Lattice raw_lat;
+    decoder_->Decoder().GetRawLattice(&raw_lat, true);
+    raw_lattice_states_ = raw_lat.NumStates();
+    DeterminizeLatticePhonePrunedWrapper(*model_->trans_model_, &raw_lat,
+                                         model_->nnet3_decoding_config_.lattice_beam,
+                                         &clat, model_->nnet3_decoding_config_.det_opts);
+    lattice_states_ = clat.NumStates();
+    if (collect_stats_) {
+        pending_stats_.lattice += timer.Elapsed();
+    }
+    timer.Reset();
 
-        // Add CARPA score
-        TopSortCompactLatticeIfNeeded(&slat);
-        ComposeCompactLatticeDeterministic(slat, carpa_to_add_, &tlat);
+    if (lm_to_subtract_scale_ && carpa_to_add_) {
+        // Replace the graph LM score with the CARPA score in one deterministic
+        // composition, the lattice stays determinized
+        fst::ComposeDeterministicOnDemandFst<StdArc> carpa_rescore(lm_to_subtract_scale_, carpa_to_add_);
+        TopSortCompactLatticeIfNeeded(&clat);
+        ComposeCompactLatticeDeterministic(clat, &carpa_rescore, &tlat);
 
         // Rescore with RNNLM score on top if needed
         if (rnnlm_to_add_scale_) {
              ComposeLatticePrunedOptions compose_opts;
-             compose_opts.lattice_compose_beam = 3.0;
-             compose_opts.max_arcs = 3000;
+             compose_opts.lattice_compose_beam = rescore_beam_;
+             compose_opts.max_arcs = rescore_max_arcs_;
              fst::ComposeDeterministicOnDemandFst<StdArc> combined_rnnlm(carpa_to_add_scale_, rnnlm_to_add_scale_);
 
              TopSortCompactLatticeIfNeeded(&tlat);
              ComposeCompactLatticePruned(compose_opts, tlat,
                                          &combined_rnnlm, &rlat);
+
+             // States stay in the model cache for the next utterances
              rnnlm_to_add_->Clear();
         } else {
              rlat = tlat;
@@ -628,6 +1174,16 @@ const char* Recognizer::GetResult()
         rlat = clat;
     }
 
+    if (hotword_fst_) {
+        CompactLattice blat;
+        TopSortCompactLatticeIfNeeded(&rlat);
+        ComposeCompactLatticeDeterministic(rlat, hotword_fst_, &blat);
+        rlat = blat;
+    }
+    if (collect_stats_) {
+        pending_stats_.rescoring += timer.Elapsed();
+    }
+
     // Pruned composition can return empty lattice. It should be rare
     if (rlat.Start() != 0) {
        return StoreEmptyReturn();
@@ -645,35 +1201,132 @@ const char* Recognizer::GetResult()
 }
 
 
+// Words older than that are returned as stable by incremental partial results
+#define PARTIAL_STABLE_FRAMES 50
+
+void Recognizer::ClearBestPath()
+{
+    best_path_.clear();
+    best_path_index_.clear();
+    committed_words_ = 0;
+}
+
+void Recognizer::UpdateBestPath()
+{
+    const LatticeFasterOnlineDecoder &decoder = decoder_->Decoder();
+
+    // Trace back until we meet a token of the cached path. The same token
+    // address at the same frame is the same token, freed tokens are only
+    // reused for the new frames.
+    std::vector<PathEntry> suffix;
+    size_t keep = 0;
+    LatticeFasterOnlineDecoder::BestPathIterator iter = decoder.BestPathEnd(false);
+    while (!iter.Done()) {
+        auto it = best_path_index_.find(iter.tok);
+        if (it != best_path_index_.end() && best_path_[it->second].frame == iter.frame) {
+            keep = it->second + 1;
+            break;
+        }
+        LatticeArc arc;
+        PathEntry entry;
+        entry.tok = iter.tok;
+        entry.frame = iter.frame;
+        iter = decoder.TraceBackBestPath(iter, &arc);
+        entry.word = arc.olabel;
+        suffix.push_back(entry);
+    }
+
+    for (size_t i = keep; i < best_path_.size(); i++) {
+        best_path_index_.erase(best_path_[i].tok);
+    }
+    best_path_.resize(keep);
+
+    int32 num_words = keep ? best_path_.back().num_words : 0;
+    for (auto it = suffix.rbegin(); it != suffix.rend(); ++it) {
+        if (it->word != 0) {
+            num_words++;
+        }
+        it->num_words = num_words;
+        best_path_index_[it->tok] = best_path_.size();
+        best_path_.push_back(*it);
+    }
+}
+
+string Recognizer::BestPathText(int32 begin_word, int32 end_word)
+{
+    // First entry with the word number begin_word
+    auto it = std::upper_bound(best_path_.begin(), best_path_.end(), begin_word,
+                               [](int32 n, const PathEntry &entry) { return n < entry.num_words; });
+
+    ostringstream text;
+    for (int32 n = begin_word; it != best_path_.end() && n < end_word; ++it) {
+        if (it->word == 0) {
+            continue;
+        }
+        if (n > begin_word) {
+            text << " ";
+        }
+        text << model_->word_syms_->Find(it->word);
+        n++;
+    }
+    return text.str();
+}
+
 const char* Recognizer::PartialResult()
 {
     if (state_ != RECOGNIZER_RUNNING) {
         return StoreEmptyReturn();
     }
+    pending_stats_.partial_results++;
+
+    // Partial results have only the text
+    ClearResultData();
+    AddResultAlternative(0.0);
 
-    json::JSON res;
+    json::JSONWriter writer(last_result_);
+    writer.BeginObject();
 
     if (decoder_->NumFramesDecoded() == 0) {
-        res["partial"] = "";
-        return StoreReturn(res.dump());
+        FinishResultData();
+        writer.Member("partial", "");
+        if (incremental_partial_) {
+            writer.Member("stable", "");
+        }
+        writer.EndObject();
+        return last_result_.c_str();
     }
 
-    Lattice lat;
-    decoder_->GetBestPath(false, &lat);
-    vector<kaldi::int32> alignment, words;
-    LatticeWeight weight;
-    GetLinearSymbolSequence(lat, &alignment, &words, &weight);
+    UpdateBestPath();
+    int32 num_words = best_path_.empty() ? 0 : best_path_.back().num_words;
 
-    ostringstream text;
-    for (size_t i = 0; i < words.size(); i++) {
-        if (i) {
-            text << " ";
-        }
-        text << model_->word_syms_->Find(words[i]);
+    if (!incremental_partial_) {
+        string partial = BestPathText(0, num_words);
+        SetResultText(partial);
+        FinishResultData();
+        writer.Member("partial", partial);
+        writer.EndObject();
+        return last_result_.c_str();
     }
-    res["partial"] = text.str();
 
-    return StoreReturn(res.dump());
+    // Entries are ordered by frame, find the last one old enough to be stable
+    int32 stable_frame = decoder_->NumFramesDecoded() - PARTIAL_STABLE_FRAMES;
+    auto it = std::lower_bound(best_path_.begin(), best_path_.end(), stable_frame,
+                               [](const PathEntry &entry, int32 frame) { return entry.frame < frame; });
+    int32 stable_words = it == best_path_.begin() ? 0 : (it - 1)->num_words;
+
+    // Once returned, stable words are not repeated even if the best path changes
+    int32 begin_word = committed_words_;
+    committed_words_ = std::max(committed_words_, stable_words);
+
+    string stable = BestPathText(begin_word, committed_words_);
+    string partial = BestPathText(committed_words_, num_words);
+    SetResultText(partial);
+    FinishResultData();
+    writer.Member("partial", partial);
+    writer.Member("stable", stable);
+    writer.EndObject();
+
+    return last_result_.c_str();
 }
 
 const char* Recognizer::Result()
@@ -683,7 +1336,10 @@ const char* Recognizer::Result()
     }
     decoder_->FinalizeDecoding();
     state_ = RECOGNIZER_ENDPOINT;
-    return GetResult();
+    GetResult();
+    pending_stats_.results++;
+    FlushStats();
+    return last_result_.c_str();
 }
 
 const char* Recognizer::FinalResult()
@@ -694,10 +1350,21 @@ const char* Recognizer::FinalResult()
 
     feature_pipeline_->InputFinished();
     UpdateSilenceWeights();
-    decoder_->AdvanceDecoding();
+    int32 num_frames_decoded = decoder_->NumFramesDecoded();
+    {
+        StatsTimer timer(TimeCounter(pending_stats_.decode));
+        decoder_->AdvanceDecoding();
+    }
+    pending_stats_.frames_decoded += decoder_->NumFramesDecoded() - num_frames_decoded;
     decoder_->FinalizeDecoding();
     state_ = RECOGNIZER_FINALIZED;
+    if (spk_feature_ && spk_window_ > 0) {
+        spk_feature_->InputFinished();
+        UpdateSpkWindows(true);
+    }
     GetResult();
+    pending_stats_.results++;
+    FlushStats();
 
     // Free some memory while we are finalized, next
     // iteration will reinitialize them anyway
@@ -723,8 +1390,133 @@ void Recognizer::Reset()
     state_ = RECOGNIZER_ENDPOINT;
 }
 
+void Recognizer::Recycle()
+{
+    // Queued async work still uses the pipeline and the callback of the
+    // previous owner, the next one must not get its results
+    WaitAsync();
+    result_callback_ = nullptr;
+    result_user_data_ = nullptr;
+
+    // Nothing was decoded since the decoder was created
+    if (state_ == RECOGNIZER_INITIALIZED && decoder_) {
+        return;
+    }
+    FlushStats();
+
+    // Kaldi pipeline can not restart after the input is finished, so it is
+    // created again here, off the path of the next utterance. The graph
+    // and the rescoring caches of the recognizer stay warm.
+    delete decoder_;
+    delete feature_pipeline_;
+    delete silence_weighting_;
+    delete spk_feature_;
+    spk_feature_ = nullptr;
+
+    feature_pipeline_ = new kaldi::OnlineNnet2FeaturePipeline (*model_->feature_info_);
+    silence_weighting_ = new kaldi::OnlineSilenceWeighting(*model_->trans_model_, model_->feature_info_->silence_weighting_config, 3);
+    decoder_ = NewDecoder();
+
+    if (spk_model_) {
+        spk_feature_ = new OnlineMfcc(spk_model_->spkvector_mfcc_opts);
+    }
+    ResetSpkWindows();
+
+    InitState();
+    ClearBestPath();
+    tail_audio_.clear();
+    last_result_.clear();
+    vad_detector_.Reset();
+    vad_gated_ = false;
+    vad_speech_fed_ = false;
+    vad_silence_samples_ = 0;
+}
+
+void Recognizer::SetResultCallback(AsyncResultCallback callback, void *user_data)
+{
+    result_callback_ = callback;
+    result_user_data_ = user_data;
+}
+
+void Recognizer::AcceptWaveformAsync(const char *data, int len)
+{
+    // Copy the audio, the caller may reuse the buffer right away
+    std::vector<short> samples((const short *)data, (const short *)data + len / 2);
+    ScheduleAsync([this, samples]() {
+        bool endpoint = AcceptWaveform(samples.data(), samples.size());
+        if (result_callback_) {
+            if (endpoint) {
+                result_callback_(result_user_data_, ASYNC_RESULT_ENDPOINT, Result());
+            } else {
+                result_callback_(result_user_data_, ASYNC_RESULT_PARTIAL, PartialResult());
+            }
+        }
+    });
+}
+
+void Recognizer::FinishAsync()
+{
+    ScheduleAsync([this]() {
+        const char *res = FinalResult();
+        if (result_callback_) {
+            result_callback_(result_user_data_, ASYNC_RESULT_FINAL, res);
+        }
+    });
+}
+
+void Recognizer::WaitAsync()
+{
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    async_cond_.wait(lock, [this]() { return !async_running_; });
+}
+
+void Recognizer::ScheduleAsync(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        async_tasks_.push_back(std::move(task));
+        if (async_running_) {
+            return;
+        }
+        async_running_ = true;
+    }
+    AsyncPool::Get().Schedule([this]() { RunAsync(); });
+}
+
+// Runs a single task of the recognizer per pool job, so that streams
+// with a lot of queued audio don't hold the threads from other streams
+void Recognizer::RunAsync()
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        task = std::move(async_tasks_.front());
+        async_tasks_.pop_front();
+    }
+
+    try {
+        task();
+    } catch (const std::exception &e) {
+        KALDI_WARN << "Asynchronous processing failed: " << e.what();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        if (async_tasks_.empty()) {
+            async_running_ = false;
+            async_cond_.notify_all();
+            return;
+        }
+    }
+    AsyncPool::Get().Schedule([this]() { RunAsync(); });
+}
+
 const char *Recognizer::StoreEmptyReturn()
 {
+    ClearResultData();
+    AddResultAlternative(max_alternatives_ ? 1.0 : 0.0);
+    FinishResultData();
+
     if (!max_alternatives_) {
         return StoreReturn("{\"text\": \"\"}");
     } else {
@@ -738,3 +1530,148 @@ const char *Recognizer::StoreReturn(const string &res)
     last_result_ = res;
     return last_result_.c_str();
 }
+
+void Recognizer::ClearResultData()
+{
+    result_alternatives_.clear();
+    result_words_.clear();
+    result_word_offsets_.clear();
+    result_strings_.clear();
+    result_spk_.clear();
+    result_spk_frames_ = 0;
+    result_spk_windows_.clear();
+    result_spk_window_values_.clear();
+}
+
+void Recognizer::AddResultAlternative(float confidence)
+{
+    ResultAlternative alternative;
+    alternative.text = result_strings_.size();
+    alternative.confidence = confidence;
+    alternative.first_word = result_words_.size();
+    alternative.num_words = 0;
+    result_alternatives_.push_back(alternative);
+    result_strings_.push_back('\0');
+}
+
+void Recognizer::AddResultWord(int32 id, const string &word, float start, float end, float conf)
+{
+    ResultWord result_word;
+    result_word.word = nullptr;
+    result_word.id = id;
+    result_word.start = start;
+    result_word.end = end;
+    result_word.conf = conf;
+    result_words_.push_back(result_word);
+    result_word_offsets_.push_back(result_strings_.size());
+    result_strings_.append(word.c_str(), word.size() + 1);
+    result_alternatives_.back().num_words++;
+}
+
+void Recognizer::SetResultText(const string &text)
+{
+    result_alternatives_.back().text = result_strings_.size();
+    result_strings_.append(text.c_str(), text.size() + 1);
+}
+
+// The string buffer doesn't grow anymore, set the pointers into it
+void Recognizer::FinishResultData()
+{
+    for (size_t i = 0; i < result_words_.size(); i++) {
+        result_words_[i].word = result_strings_.c_str() + result_word_offsets_[i];
+    }
+}
+
+int Recognizer::NumResultAlternatives() const
+{
+    return result_alternatives_.size();
+}
+
+const char *Recognizer::ResultText(int alternative) const
+{
+    if (alternative < 0 || alternative >= (int)result_alternatives_.size()) {
+        return nullptr;
+    }
+    return result_strings_.c_str() + result_alternatives_[alternative].text;
+}
+
+float Recognizer::ResultConfidence(int alternative) const
+{
+    if (alternative < 0 || alternative >= (int)result_alternatives_.size()) {
+        return 0.0;
+    }
+    return result_alternatives_[alternative].confidence;
+}
+
+const ResultWord *Recognizer::ResultWords(int alternative, int *num_words) const
+{
+    if (alternative < 0 || alternative >= (int)result_alternatives_.size()) {
+        *num_words = 0;
+        return nullptr;
+    }
+    const ResultAlternative &result = result_alternatives_[alternative];
+    *num_words = result.num_words;
+    return result.num_words ? &result_words_[result.first_word] : nullptr;
+}
+
+const float *Recognizer::ResultSpk(int *dim, int *num_frames) const
+{
+    *dim = result_spk_.size();
+    *num_frames = result_spk_frames_;
+    return result_spk_.empty() ? nullptr : result_spk_.data();
+}
+
+int Recognizer::NumResultSpkWindows() const
+{
+    return result_spk_windows_.size();
+}
+
+const float *Recognizer::ResultSpkWindow(int index, float *start, float *end, int *dim) const
+{
+    if (index < 0 || index >= (int)result_spk_windows_.size()) {
+        *dim = 0;
+        return nullptr;
+    }
+    const ResultSpkWindow &window = result_spk_windows_[index];
+    *start = window.start;
+    *end = window.end;
+    *dim = window.dim;
+    return &result_spk_window_values_[window.offset];
+}
+
+void Recognizer::SetCollectStats(bool collect)
+{
+    collect_stats_ = collect;
+}
+
+double *Recognizer::TimeCounter(double &counter)
+{
+    return collect_stats_ ? &counter : nullptr;
+}
+
+// Counters are passed to the model after every result, so the model sees
+// them without locking on the hot path
+void Recognizer::FlushStats()
+{
+    stats_.Add(pending_stats_);
+    model_->AddStats(pending_stats_);
+    pending_stats_ = RecognizerStats();
+}
+
+RecognizerStats Recognizer::Stats() const
+{
+    RecognizerStats stats = stats_;
+    stats.Add(pending_stats_);
+    return stats;
+}
+
+const char *Recognizer::GetStats()
+{
+    json::JSON obj;
+    Stats().ToJson(obj);
+    obj["lattice_states"] = lattice_states_;
+    obj["raw_lattice_states"] = raw_lattice_states_;
+    obj["collect_time"] = collect_stats_;
+    stats_json_ = obj.dump();
+    return stats_json_.c_str();
+}
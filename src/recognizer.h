@@ -29,10 +29,42 @@
 #include "nnet3/nnet-utils.h"
 
 #include "model.h"
+#include "model_registry.h"
 #include "spk_model.h"
+#include "recognizer_stats.h"
+#include "audio_utils.h"
+#include "hotword_fst.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
 
 using namespace kaldi;
 
+namespace json {
+class JSONWriter;
+}
+
+// Values match VoskResultType of the C API
+enum AsyncResultType {
+    ASYNC_RESULT_PARTIAL,
+    ASYNC_RESULT_ENDPOINT,
+    ASYNC_RESULT_FINAL
+};
+
+typedef void (*AsyncResultCallback)(void *user_data, int type, const char *result);
+
+// Word of a structured result, same layout as VoskWord of the C API
+struct ResultWord {
+    const char *word;
+    int id;
+    float start;
+    float end;
+    float conf;
+};
+
 enum RecognizerState {
     RECOGNIZER_INITIALIZED,
     RECOGNIZER_RUNNING,
@@ -45,10 +77,20 @@ class Recognizer {
         Recognizer(Model *model, float sample_frequency);
         Recognizer(Model *model, float sample_frequency, SpkModel *spk_model);
         Recognizer(Model *model, float sample_frequency, char const *grammar);
+        // Follows the current model of the registry, the model is switched
+        // at the utterance boundary
+        Recognizer(ModelRegistry *registry, float sample_frequency, char const *grammar = nullptr);
         ~Recognizer();
         void SetMaxAlternatives(int max_alternatives);
         void SetSpkModel(SpkModel *spk_model);
         void SetWords(bool words);
+        void SetIncrementalPartial(bool incremental);
+        void SetRescoringPruning(float beam, int max_arcs);
+        void SetChunkSize(float chunk_size);
+        void SetSilenceWeightInterval(float interval);
+        void SetSpkWindow(float window, float shift);
+        void SetVad(bool vad);
+        void SetHotwords(const char *hotwords);
         bool AcceptWaveform(const char *data, int len);
         bool AcceptWaveform(const short *sdata, int len);
         bool AcceptWaveform(const float *fdata, int len);
@@ -56,44 +98,129 @@ class Recognizer {
         const char* FinalResult();
         const char* PartialResult();
         void Reset();
+        // Prepares a fresh decoder and feature pipeline for the next
+        // utterance while the recognizer waits in a pool, after the
+        // queued async work is done
+        void Recycle();
+
+        // Asynchronous mode, audio is decoded by the shared pool in the order
+        // it was queued and the results are passed to the callback
+        void SetResultCallback(AsyncResultCallback callback, void *user_data);
+        void AcceptWaveformAsync(const char *data, int len);
+        void FinishAsync();
+        void WaitAsync();
+
+        // Times are only collected when enabled, the other counters always
+        void SetCollectStats(bool collect);
+        RecognizerStats Stats() const;
+        const char *GetStats();
+
+        // Structured view of the last result, the memory is owned by the
+        // recognizer and stays valid until the next result is produced
+        int NumResultAlternatives() const;
+        const char *ResultText(int alternative) const;
+        float ResultConfidence(int alternative) const;
+        const ResultWord *ResultWords(int alternative, int *num_words) const;
+        const float *ResultSpk(int *dim, int *num_frames) const;
+        int NumResultSpkWindows() const;
+        const float *ResultSpkWindow(int index, float *start, float *end, int *dim) const;
 
     private:
         void InitState();
+        void InitGraph();
+        OnlineNnet3Decoder *NewDecoder();
         void InitRescoring();
+        void FreeRescoring();
+        Model *SwitchModel();
         void CleanUp();
+        void RestartPipeline(bool keep_adaptation = true);
+        void ResetPipeline(const VectorBase<BaseFloat> &audio, bool keep_adaptation = true);
+        int GateSilence(const VectorBase<BaseFloat> &wdata, int offset, int len);
         void UpdateSilenceWeights();
-        bool AcceptWaveform(Vector<BaseFloat> &wdata);
+        void UpdateBestPath();
+        void ClearBestPath();
+        string BestPathText(int32 begin_word, int32 end_word);
+        double *TimeCounter(double &counter);
+        void FlushStats();
+        void ScheduleAsync(std::function<void()> task);
+        void RunAsync();
+        bool AcceptWaveform(const VectorBase<BaseFloat> &wdata);
         bool GetSpkVector(Vector<BaseFloat> &out_xvector, int *frames);
+        void CopySpkFeatures();
+        void ComputeSpkVector(const MatrixBase<BaseFloat> &mfcc, Vector<BaseFloat> *out_xvector);
+        void UpdateSpkWindows(bool finished);
+        void ResetSpkWindows();
+        void AddSpkWindows(json::JSONWriter &writer);
         const char *GetResult();
         const char *StoreEmptyReturn();
+        void ClearResultData();
+        void AddResultAlternative(float confidence);
+        void AddResultWord(int32 id, const string &word, float start, float end, float conf);
+        void SetResultText(const string &text);
+        void FinishResultData();
         const char *StoreReturn(const string &res);
         const char *MbrResult(CompactLattice &clat);
         const char *NbestResult(CompactLattice &clat);
 
         Model *model_ = nullptr;
-        SingleUtteranceNnet3Decoder *decoder_ = nullptr;
-        fst::LookaheadFst<fst::StdArc, int32> *decode_fst_ = nullptr;
-        fst::StdVectorFst *g_fst_ = nullptr; // dynamically constructed grammar
+        ModelRegistry *registry_ = nullptr;
+        int model_version_ = 0;
+        // Kept to create the graph and hotwords again for a new model
+        bool has_grammar_ = false;
+        string grammar_;
+        string hotwords_;
+        OnlineNnet3Decoder *decoder_ = nullptr;
+        fst::Fst<fst::StdArc> *decode_fst_ = nullptr;
+        std::shared_ptr<const fst::StdVectorFst> g_fst_; // dynamically constructed grammar, shared by the model
         OnlineNnet2FeaturePipeline *feature_pipeline_ = nullptr;
         OnlineSilenceWeighting *silence_weighting_ = nullptr;
 
         // Speaker identification
         SpkModel *spk_model_ = nullptr;
         OnlineBaseFeature *spk_feature_ = nullptr;
+        Matrix<BaseFloat> spk_feats_; // Features copied from spk_feature_ so far
+        int32 spk_frames_copied_ = 0;
+
+        // Speaker vectors over sliding windows, computed while the audio
+        // arrives and returned with the next result
+        struct SpkWindow {
+            BaseFloat start;
+            BaseFloat end;
+            Vector<BaseFloat> xvector;
+        };
+        float spk_window_ = 0; // Window length in seconds, 0 disables windows
+        float spk_window_shift_ = 0;
+        int32 spk_window_start_ = 0; // First feature frame of the next window
+        std::vector<SpkWindow> spk_windows_;
 
         // Rescoring
-        fst::ArcMapFst<fst::StdArc, LatticeArc, fst::StdToLatticeMapper<BaseFloat> > *lm_to_subtract_ = nullptr;
+        fst::BackoffDeterministicOnDemandFst<fst::StdArc> *lm_to_subtract_ = nullptr;
+        fst::ScaleDeterministicOnDemandFst *lm_to_subtract_scale_ = nullptr;
         kaldi::ConstArpaLmDeterministicFst *carpa_to_add_ = nullptr;
         fst::ScaleDeterministicOnDemandFst *carpa_to_add_scale_ = nullptr;
-        // RNNLM rescoring
-        kaldi::rnnlm::KaldiRnnlmDeterministicFst* rnnlm_to_add_ = nullptr;
-        fst::DeterministicOnDemandFst<fst::StdArc> *rnnlm_to_add_scale_ = nullptr;
-        kaldi::rnnlm::RnnlmComputeStateInfo *rnnlm_info_ = nullptr;
+        // RNNLM rescoring, states are shared by the model
+        SharedRnnlmDeterministicFst *rnnlm_to_add_ = nullptr;
+        fst::ScaleDeterministicOnDemandFst *rnnlm_to_add_scale_ = nullptr;
+        float rescore_beam_ = 3.0;
+        int32 rescore_max_arcs_ = 3000;
+        // Contextual phrases boosted in the lattice
+        HotwordFst *hotword_fst_ = nullptr;
 
 
         // Other
         int max_alternatives_ = 0; // Disable alternatives by default
         bool words_ = false;
+        bool incremental_partial_ = false;
+        float chunk_size_ = 0.2; // Seconds of audio per decoding step
+        float silence_weight_interval_ = 0; // Update silence weights after every step by default
+        int64 samples_since_silence_update_ = 0;
+
+        // Silence between utterances is not decoded when enabled
+        bool vad_ = false;
+        EnergyVad vad_detector_;
+        bool vad_gated_ = false; // The audio is skipped
+        bool vad_speech_fed_ = false; // Speech was decoded since the last endpoint
+        int64 vad_silence_samples_ = 0; // Length of the current silence
 
         float sample_frequency_;
         int32 frame_offset_;
@@ -103,6 +230,63 @@ class Recognizer {
 
         RecognizerState state_;
         string last_result_;
+
+        // Statistics, the pending counters are not yet passed to the model
+        bool collect_stats_ = false;
+        RecognizerStats stats_;
+        RecognizerStats pending_stats_;
+        int32 lattice_states_ = 0;
+        int32 raw_lattice_states_ = 0;
+        string stats_json_;
+
+        // Best path of the current utterance cached between partial results.
+        // Tokens of decoded frames don't change, so only the part after the
+        // last token shared with the previous traceback has to be traced again.
+        struct PathEntry {
+            void *tok;
+            int32 frame;
+            int32 word;
+            int32 num_words; // Words up to and including this entry
+        };
+        std::vector<PathEntry> best_path_;
+        std::unordered_map<void *, size_t> best_path_index_;
+        int32 committed_words_ = 0; // Words already returned as stable
+
+        // Structured data of the last result. Strings are stored in one
+        // buffer, the pointers are set once all of them are added.
+        struct ResultAlternative {
+            size_t text; // Offset in result_strings_
+            float confidence;
+            size_t first_word;
+            size_t num_words;
+        };
+        struct ResultSpkWindow {
+            float start;
+            float end;
+            size_t offset; // Offset in result_spk_window_values_
+            int dim;
+        };
+        std::vector<ResultAlternative> result_alternatives_;
+        std::vector<ResultWord> result_words_;
+        std::vector<size_t> result_word_offsets_;
+        string result_strings_;
+        std::vector<float> result_spk_;
+        int result_spk_frames_ = 0;
+        std::vector<ResultSpkWindow> result_spk_windows_;
+        std::vector<float> result_spk_window_values_;
+
+        // Reusable buffer for converted samples
+        std::vector<BaseFloat> wave_buffer_;
+        // Last seconds of audio, decoded again after the pipeline restart
+        std::vector<BaseFloat> tail_audio_;
+
+        // Asynchronous processing, tasks are run one at a time
+        AsyncResultCallback result_callback_ = nullptr;
+        void *result_user_data_ = nullptr;
+        std::mutex async_mutex_;
+        std::condition_variable async_cond_;
+        std::deque<std::function<void()> > async_tasks_;
+        bool async_running_ = false;
 };
 
 #endif /* VOSK_KALDI_RECOGNIZER_H */
@@ -0,0 +1,84 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "recognizer_pool.h"
+
+RecognizerPool::RecognizerPool(Model *model, float sample_frequency, int size, const char *grammar)
+    : model_(model), sample_frequency_(sample_frequency), size_(std::max(size, 0)),
+      has_grammar_(grammar != nullptr), grammar_(grammar ? grammar : "")
+{
+    model_->Ref();
+
+    try {
+        for (size_t i = 0; i < size_; i++) {
+            idle_.push_back(NewRecognizer());
+        }
+    } catch (...) {
+        for (Recognizer *recognizer : idle_) {
+            delete recognizer;
+        }
+        model_->Unref();
+        throw;
+    }
+}
+
+RecognizerPool::~RecognizerPool()
+{
+    for (Recognizer *recognizer : idle_) {
+        delete recognizer;
+    }
+    model_->Unref();
+}
+
+Recognizer *RecognizerPool::NewRecognizer()
+{
+    if (has_grammar_) {
+        return new Recognizer(model_, sample_frequency_, grammar_.c_str());
+    }
+    return new Recognizer(model_, sample_frequency_);
+}
+
+Recognizer *RecognizerPool::Acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!idle_.empty()) {
+            Recognizer *recognizer = idle_.back();
+            idle_.pop_back();
+            return recognizer;
+        }
+    }
+    return NewRecognizer();
+}
+
+void RecognizerPool::Release(Recognizer *recognizer)
+{
+    // Rebuild the decoder outside of the lock, releases from
+    // different threads don't wait for each other
+    try {
+        recognizer->Recycle();
+    } catch (...) {
+        delete recognizer;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() < size_) {
+            idle_.push_back(recognizer);
+            return;
+        }
+    }
+    delete recognizer;
+}
@@ -0,0 +1,49 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_RECOGNIZER_POOL_H
+#define VOSK_RECOGNIZER_POOL_H
+
+#include "model.h"
+#include "recognizer.h"
+
+#include <mutex>
+#include <vector>
+
+// Keeps ready to use recognizers for a model. Released recognizers are
+// prepared for the next utterance and handed out again instead of being
+// destroyed, so the composed graph and rescoring caches are reused.
+class RecognizerPool {
+    public:
+        RecognizerPool(Model *model, float sample_frequency, int size, const char *grammar = nullptr);
+        ~RecognizerPool();
+
+        // Returns an idle recognizer or creates a new one if all are in use
+        Recognizer *Acquire();
+        void Release(Recognizer *recognizer);
+
+    private:
+        Recognizer *NewRecognizer();
+
+        Model *model_;
+        float sample_frequency_;
+        size_t size_;
+        bool has_grammar_;
+        string grammar_;
+
+        std::mutex mutex_;
+        std::vector<Recognizer *> idle_;
+};
+
+#endif /* VOSK_RECOGNIZER_POOL_H */
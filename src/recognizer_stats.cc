@@ -0,0 +1,58 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "recognizer_stats.h"
+#include "json.h"
+
+void RecognizerStats::Add(const RecognizerStats &other)
+{
+    audio_seconds += other.audio_seconds;
+    frames_decoded += other.frames_decoded;
+    results += other.results;
+    partial_results += other.partial_results;
+    skipped_seconds += other.skipped_seconds;
+    features += other.features;
+    decode += other.decode;
+    silence_weights += other.silence_weights;
+    lattice += other.lattice;
+    rescoring += other.rescoring;
+    mbr += other.mbr;
+    speaker += other.speaker;
+    serialization += other.serialization;
+}
+
+double RecognizerStats::TotalTime() const
+{
+    return features + decode + silence_weights + lattice + rescoring + mbr + speaker + serialization;
+}
+
+void RecognizerStats::ToJson(json::JSON &obj) const
+{
+    obj["audio_seconds"] = audio_seconds;
+    obj["frames_decoded"] = frames_decoded;
+    obj["results"] = results;
+    obj["partial_results"] = partial_results;
+    obj["skipped_seconds"] = skipped_seconds;
+    obj["rtf"] = audio_seconds > 0 ? TotalTime() / audio_seconds : 0.0;
+
+    json::JSON &time = obj["time"];
+    time["features"] = features;
+    time["decode"] = decode;
+    time["silence_weights"] = silence_weights;
+    time["lattice"] = lattice;
+    time["rescoring"] = rescoring;
+    time["mbr"] = mbr;
+    time["speaker"] = speaker;
+    time["serialization"] = serialization;
+}
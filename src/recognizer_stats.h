@@ -0,0 +1,68 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_RECOGNIZER_STATS_H
+#define VOSK_RECOGNIZER_STATS_H
+
+#include "base/kaldi-common.h"
+
+#include <chrono>
+
+namespace json {
+class JSON;
+}
+
+// Counters of a recognizer, times are in seconds. The model sums up
+// the counters of all its recognizers.
+struct RecognizerStats {
+    double audio_seconds = 0;
+    kaldi::int64 frames_decoded = 0;
+    kaldi::int64 results = 0;
+    kaldi::int64 partial_results = 0;
+    double skipped_seconds = 0; // Silence not decoded, see Recognizer::SetVad
+
+    double features = 0;        // Feature extraction of the audio
+    double decode = 0;          // AdvanceDecoding, includes nnet3 computation
+    double silence_weights = 0; // Traceback for the silence weights
+    double lattice = 0;         // Lattice determinization
+    double rescoring = 0;       // Lattice rescoring with CARPA and RNNLM
+    double mbr = 0;             // MBR decoding or N-best search
+    double speaker = 0;         // Speaker vectors
+    double serialization = 0;   // Result serialization
+
+    void Add(const RecognizerStats &other);
+    double TotalTime() const;
+    // Adds the counters to the object
+    void ToJson(json::JSON &obj) const;
+};
+
+// Adds the time spent in the scope to the counter, does
+// nothing when the counter is null
+class StatsTimer {
+    public:
+        explicit StatsTimer(double *counter) : counter_(counter) {
+            if (counter_)
+                start_ = std::chrono::steady_clock::now();
+        }
+        ~StatsTimer() {
+            if (counter_)
+                *counter_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        }
+
+    private:
+        double *counter_;
+        std::chrono::steady_clock::time_point start_;
+};
+
+#endif /* VOSK_RECOGNIZER_STATS_H */
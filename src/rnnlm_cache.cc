@@ -0,0 +1,111 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rnnlm_cache.h"
+
+using namespace kaldi;
+using namespace kaldi::rnnlm;
+
+RnnlmStateCache::RnnlmStateCache(const RnnlmComputeStateComputationOptions &opts,
+                                 const nnet3::Nnet &rnnlm,
+                                 const CuMatrix<BaseFloat> &word_embedding_mat,
+                                 size_t max_states)
+    : info_(opts, rnnlm, word_embedding_mat), max_states_(max_states)
+{
+    start_ = std::make_shared<const RnnlmComputeState>(info_, opts.bos_index);
+}
+
+std::shared_ptr<const RnnlmComputeState> RnnlmStateCache::GetState(const History &history,
+        const RnnlmComputeState &prev, int32 word)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = states_.find(history);
+        if (it != states_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->second;
+        }
+    }
+
+    // Run the network outside of the lock, states are only read once created
+    std::shared_ptr<const RnnlmComputeState> state(prev.GetSuccessorState(word));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = states_.find(history);
+    if (it != states_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+    lru_.emplace_front(history, state);
+    states_[history] = lru_.begin();
+    if (lru_.size() > max_states_) {
+        states_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+    return state;
+}
+
+SharedRnnlmDeterministicFst::SharedRnnlmDeterministicFst(int32 max_ngram_order, RnnlmStateCache *cache)
+    : max_ngram_order_(max_ngram_order), cache_(cache)
+{
+    Clear();
+}
+
+void SharedRnnlmDeterministicFst::Clear()
+{
+    state_to_wseq_.clear();
+    state_to_rnnlm_state_.clear();
+    wseq_to_state_.clear();
+
+    History bos_seq;
+    state_to_wseq_.push_back(bos_seq);
+    state_to_rnnlm_state_.push_back(cache_->Start());
+    wseq_to_state_[bos_seq] = 0;
+}
+
+fst::StdArc::Weight SharedRnnlmDeterministicFst::Final(StateId s)
+{
+    KALDI_ASSERT(static_cast<size_t>(s) < state_to_wseq_.size());
+    BaseFloat logprob = state_to_rnnlm_state_[s]->LogProbOfWord(cache_->Info().opts.eos_index);
+    return Weight(-logprob);
+}
+
+bool SharedRnnlmDeterministicFst::GetArc(StateId s, Label ilabel, fst::StdArc *oarc)
+{
+    KALDI_ASSERT(static_cast<size_t>(s) < state_to_wseq_.size());
+
+    History wseq = state_to_wseq_[s];
+    BaseFloat logprob = state_to_rnnlm_state_[s]->LogProbOfWord(ilabel);
+
+    // History state has at most max_ngram_order_ - 1 words
+    wseq.push_back(ilabel);
+    if (max_ngram_order_ > 0) {
+        while (wseq.size() >= static_cast<size_t>(max_ngram_order_)) {
+            wseq.erase(wseq.begin(), wseq.begin() + 1);
+        }
+    }
+
+    auto result = wseq_to_state_.insert(std::make_pair(wseq, static_cast<StateId>(state_to_wseq_.size())));
+    if (result.second) {
+        std::shared_ptr<const RnnlmComputeState> state = cache_->GetState(wseq, *state_to_rnnlm_state_[s], ilabel);
+        state_to_wseq_.push_back(wseq);
+        state_to_rnnlm_state_.push_back(state);
+    }
+
+    oarc->ilabel = ilabel;
+    oarc->olabel = ilabel;
+    oarc->nextstate = result.first->second;
+    oarc->weight = Weight(-logprob);
+    return true;
+}
@@ -0,0 +1,85 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VOSK_RNNLM_CACHE_H
+#define VOSK_RNNLM_CACHE_H
+
+#include "base/kaldi-common.h"
+#include "util/stl-utils.h"
+#include "fstext/deterministic-fst.h"
+#include "rnnlm/rnnlm-compute-state.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// RNNLM states shared by all recognizers of the model. States are keyed by
+// the truncated word history like in KaldiRnnlmDeterministicFst, so
+// recognizers rescoring similar lattices compute each history only once.
+// The number of states is bounded, least recently used are dropped.
+class RnnlmStateCache {
+    public:
+        typedef std::vector<int32> History;
+
+        RnnlmStateCache(const kaldi::rnnlm::RnnlmComputeStateComputationOptions &opts,
+                        const kaldi::nnet3::Nnet &rnnlm,
+                        const kaldi::CuMatrix<BaseFloat> &word_embedding_mat,
+                        size_t max_states);
+
+        const kaldi::rnnlm::RnnlmComputeStateInfo &Info() const { return info_; }
+        std::shared_ptr<const kaldi::rnnlm::RnnlmComputeState> Start() const { return start_; }
+
+        // Returns the state for the history, computing it from the previous
+        // state and the last word of the history if it is not cached
+        std::shared_ptr<const kaldi::rnnlm::RnnlmComputeState> GetState(const History &history,
+                const kaldi::rnnlm::RnnlmComputeState &prev, int32 word);
+
+    private:
+        typedef std::list<std::pair<History, std::shared_ptr<const kaldi::rnnlm::RnnlmComputeState> > > StateList;
+
+        kaldi::rnnlm::RnnlmComputeStateInfo info_;
+        std::shared_ptr<const kaldi::rnnlm::RnnlmComputeState> start_;
+        size_t max_states_;
+
+        std::mutex mutex_;
+        StateList lru_;
+        std::unordered_map<History, StateList::iterator, kaldi::VectorHasher<int32> > states_;
+};
+
+// Same as KaldiRnnlmDeterministicFst but takes RNNLM states from the
+// shared cache. Every recognizer owns one and clears it after rescoring.
+class SharedRnnlmDeterministicFst : public fst::DeterministicOnDemandFst<fst::StdArc> {
+    public:
+        SharedRnnlmDeterministicFst(int32 max_ngram_order, RnnlmStateCache *cache);
+
+        StateId Start() override { return 0; }
+        Weight Final(StateId s) override;
+        bool GetArc(StateId s, Label ilabel, fst::StdArc *oarc) override;
+
+        void Clear();
+
+    private:
+        typedef RnnlmStateCache::History History;
+
+        int32 max_ngram_order_;
+        RnnlmStateCache *cache_;
+
+        std::vector<History> state_to_wseq_;
+        std::vector<std::shared_ptr<const kaldi::rnnlm::RnnlmComputeState> > state_to_rnnlm_state_;
+        std::unordered_map<History, StateId, kaldi::VectorHasher<int32> > wseq_to_state_;
+};
+
+#endif /* VOSK_RNNLM_CACHE_H */
@@ -25,6 +25,9 @@ SpkModel::SpkModel(const char *speaker_path) {
     SetDropoutTestMode(true, &speaker_nnet);
     CollapseModel(nnet3::CollapseModelConfig(), &speaker_nnet);
 
+    compiler.reset(new nnet3::CachingOptimizingCompiler(speaker_nnet, nnet3::NnetOptimizeOptions(),
+                                                        nnet3::CachingOptimizingCompilerOptions()));
+
     ReadKaldiObject(speaker_path_str + "/mean.vec", &mean);
     ReadKaldiObject(speaker_path_str + "/transform.mat", &transform);
 
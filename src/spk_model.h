@@ -18,7 +18,10 @@
 #include "base/kaldi-common.h"
 #include "online2/online-feature-pipeline.h"
 #include "nnet3/nnet-utils.h"
+#include "nnet3/nnet-optimize.h"
 #include <atomic>
+#include <memory>
+#include <mutex>
 
 using namespace kaldi;
 
@@ -41,6 +44,11 @@ protected:
 
     MfccOptions spkvector_mfcc_opts;
 
+    // Compiled computations are shared by all recognizers, the requests only
+    // differ in the number of frames. The compiler itself is not thread-safe.
+    std::unique_ptr<kaldi::nnet3::CachingOptimizingCompiler> compiler;
+    std::mutex compiler_mutex;
+
     std::atomic<int> ref_cnt_;
 };
 
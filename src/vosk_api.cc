@@ -15,6 +15,9 @@
 #include "vosk_api.h"
 
 #include "recognizer.h"
+#include "recognizer_pool.h"
+#include "model_registry.h"
+#include "async_pool.h"
 #include "model.h"
 #include "spk_model.h"
 
@@ -23,7 +26,12 @@
 #include "batch_recognizer.h"
 #endif
 
+#include <limits.h>
+#include <stddef.h>
 #include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 using namespace kaldi;
 
@@ -36,6 +44,15 @@ VoskModel *vosk_model_new(const char *model_path)
     }
 }
 
+VoskModel *vosk_model_new_graph(VoskModel *am_model, const char *graph_path)
+{
+    try {
+        return (VoskModel *)new Model((Model *)am_model, graph_path);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
 void vosk_model_free(VoskModel *model)
 {
     if (model == nullptr) {
@@ -49,6 +66,44 @@ int vosk_model_find_word(VoskModel *model, const char *word)
     return (int) ((Model *)model)->FindWord(word);
 }
 
+int vosk_model_get_stats(VoskModel *model, char *buffer, int size)
+{
+    string stats = ((Model *)model)->GetStats();
+    if (size > 0) {
+        int len = std::min<int>(stats.size(), size - 1);
+        memcpy(buffer, stats.c_str(), len);
+        buffer[len] = 0;
+    }
+    return stats.size();
+}
+
+VoskModelRegistry *vosk_model_registry_new(VoskModel *model)
+{
+    try {
+        return (VoskModelRegistry *)new ModelRegistry((Model *)model);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+int vosk_model_registry_swap(VoskModelRegistry *registry, VoskModel *model)
+{
+    return ((ModelRegistry *)registry)->Swap((Model *)model);
+}
+
+int vosk_model_registry_version(VoskModelRegistry *registry)
+{
+    return ((ModelRegistry *)registry)->Version();
+}
+
+void vosk_model_registry_free(VoskModelRegistry *registry)
+{
+    if (registry == nullptr) {
+       return;
+    }
+    ((ModelRegistry *)registry)->Unref();
+}
+
 VoskSpkModel *vosk_spk_model_new(const char *model_path)
 {
     try {
@@ -93,6 +148,24 @@ VoskRecognizer *vosk_recognizer_new_grm(VoskModel *model, float sample_rate, con
     }
 }
 
+VoskRecognizer *vosk_recognizer_new_registry(VoskModelRegistry *registry, float sample_rate)
+{
+    try {
+        return (VoskRecognizer *)new Recognizer((ModelRegistry *)registry, sample_rate);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+VoskRecognizer *vosk_recognizer_new_registry_grm(VoskModelRegistry *registry, float sample_rate, const char *grammar)
+{
+    try {
+        return (VoskRecognizer *)new Recognizer((ModelRegistry *)registry, sample_rate, grammar);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
 void vosk_recognizer_set_max_alternatives(VoskRecognizer *recognizer, int max_alternatives)
 {
     ((Recognizer *)recognizer)->SetMaxAlternatives(max_alternatives);
@@ -103,6 +176,41 @@ void vosk_recognizer_set_words(VoskRecognizer *recognizer, int words)
     ((Recognizer *)recognizer)->SetWords((bool)words);
 }
 
+void vosk_recognizer_set_incremental_partial(VoskRecognizer *recognizer, int incremental)
+{
+    ((Recognizer *)recognizer)->SetIncrementalPartial((bool)incremental);
+}
+
+void vosk_recognizer_set_rescoring_pruning(VoskRecognizer *recognizer, float beam, int max_arcs)
+{
+    ((Recognizer *)recognizer)->SetRescoringPruning(beam, max_arcs);
+}
+
+void vosk_recognizer_set_chunk_size(VoskRecognizer *recognizer, float chunk_size)
+{
+    ((Recognizer *)recognizer)->SetChunkSize(chunk_size);
+}
+
+void vosk_recognizer_set_silence_weight_interval(VoskRecognizer *recognizer, float interval)
+{
+    ((Recognizer *)recognizer)->SetSilenceWeightInterval(interval);
+}
+
+void vosk_recognizer_set_spk_window(VoskRecognizer *recognizer, float window, float shift)
+{
+    ((Recognizer *)recognizer)->SetSpkWindow(window, shift);
+}
+
+void vosk_recognizer_set_vad(VoskRecognizer *recognizer, int vad)
+{
+    ((Recognizer *)recognizer)->SetVad((bool)vad);
+}
+
+void vosk_recognizer_set_hotwords(VoskRecognizer *recognizer, const char *hotwords)
+{
+    ((Recognizer *)recognizer)->SetHotwords(hotwords);
+}
+
 void vosk_recognizer_set_spk_model(VoskRecognizer *recognizer, VoskSpkModel *spk_model)
 {
     if (recognizer == nullptr || spk_model == nullptr) {
@@ -153,6 +261,61 @@ const char *vosk_recognizer_final_result(VoskRecognizer *recognizer)
     return ((Recognizer *)recognizer)->FinalResult();
 }
 
+// Words are returned without copying
+static_assert(sizeof(VoskWord) == sizeof(ResultWord) &&
+              offsetof(VoskWord, word) == offsetof(ResultWord, word) &&
+              offsetof(VoskWord, id) == offsetof(ResultWord, id) &&
+              offsetof(VoskWord, start) == offsetof(ResultWord, start) &&
+              offsetof(VoskWord, end) == offsetof(ResultWord, end) &&
+              offsetof(VoskWord, conf) == offsetof(ResultWord, conf),
+              "VoskWord must match ResultWord");
+
+int vosk_recognizer_result_num_alternatives(VoskRecognizer *recognizer)
+{
+    return ((Recognizer *)recognizer)->NumResultAlternatives();
+}
+
+const char *vosk_recognizer_result_text(VoskRecognizer *recognizer, int alternative)
+{
+    return ((Recognizer *)recognizer)->ResultText(alternative);
+}
+
+float vosk_recognizer_result_confidence(VoskRecognizer *recognizer, int alternative)
+{
+    return ((Recognizer *)recognizer)->ResultConfidence(alternative);
+}
+
+const VoskWord *vosk_recognizer_result_words(VoskRecognizer *recognizer, int alternative, int *num_words)
+{
+    return (const VoskWord *)((Recognizer *)recognizer)->ResultWords(alternative, num_words);
+}
+
+const float *vosk_recognizer_result_spk(VoskRecognizer *recognizer, int *dim, int *num_frames)
+{
+    return ((Recognizer *)recognizer)->ResultSpk(dim, num_frames);
+}
+
+int vosk_recognizer_result_num_spk_windows(VoskRecognizer *recognizer)
+{
+    return ((Recognizer *)recognizer)->NumResultSpkWindows();
+}
+
+const float *vosk_recognizer_result_spk_window(VoskRecognizer *recognizer, int index,
+                                               float *start, float *end, int *dim)
+{
+    return ((Recognizer *)recognizer)->ResultSpkWindow(index, start, end, dim);
+}
+
+void vosk_recognizer_set_stats(VoskRecognizer *recognizer, int enable)
+{
+    ((Recognizer *)recognizer)->SetCollectStats((bool)enable);
+}
+
+const char *vosk_recognizer_get_stats(VoskRecognizer *recognizer)
+{
+    return ((Recognizer *)recognizer)->GetStats();
+}
+
 void vosk_recognizer_reset(VoskRecognizer *recognizer)
 {
     ((Recognizer *)recognizer)->Reset();
@@ -163,11 +326,97 @@ void vosk_recognizer_free(VoskRecognizer *recognizer)
     delete (Recognizer *)(recognizer);
 }
 
+void vosk_recognizer_set_callback(VoskRecognizer *recognizer, VoskResultCallback callback, void *user_data)
+{
+    ((Recognizer *)recognizer)->SetResultCallback(callback, user_data);
+}
+
+int vosk_recognizer_accept_waveform_async(VoskRecognizer *recognizer, const char *data, int length)
+{
+    try {
+        ((Recognizer *)(recognizer))->AcceptWaveformAsync(data, length);
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int vosk_recognizer_finish_async(VoskRecognizer *recognizer)
+{
+    try {
+        ((Recognizer *)(recognizer))->FinishAsync();
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+void vosk_recognizer_wait_async(VoskRecognizer *recognizer)
+{
+    ((Recognizer *)(recognizer))->WaitAsync();
+}
+
+void vosk_set_async_threads(int num_threads)
+{
+    AsyncPool::Get().SetNumThreads(num_threads);
+}
+
+VoskRecognizerPool *vosk_recognizer_pool_new(VoskModel *model, float sample_rate, int size)
+{
+    try {
+        return (VoskRecognizerPool *)new RecognizerPool((Model *)model, sample_rate, size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+VoskRecognizerPool *vosk_recognizer_pool_new_grm(VoskModel *model, float sample_rate, int size, const char *grammar)
+{
+    try {
+        return (VoskRecognizerPool *)new RecognizerPool((Model *)model, sample_rate, size, grammar);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+VoskRecognizer *vosk_recognizer_pool_acquire(VoskRecognizerPool *pool)
+{
+    try {
+        return (VoskRecognizer *)((RecognizerPool *)pool)->Acquire();
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void vosk_recognizer_pool_release(VoskRecognizerPool *pool, VoskRecognizer *recognizer)
+{
+    ((RecognizerPool *)pool)->Release((Recognizer *)recognizer);
+}
+
+void vosk_recognizer_pool_free(VoskRecognizerPool *pool)
+{
+    delete (RecognizerPool *)(pool);
+}
+
 void vosk_set_log_level(int log_level)
 {
     SetVerboseLevel(log_level);
 }
 
+void vosk_set_allocator_arenas(int arenas)
+{
+#ifdef __GLIBC__
+    mallopt(M_ARENA_MAX, arenas);
+#endif
+}
+
+void vosk_release_memory()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
 void vosk_gpu_init()
 {
 #if HAVE_CUDA
@@ -185,10 +434,14 @@ void vosk_gpu_thread_init()
 #endif
 }
 
-VoskBatchRecognizer *vosk_batch_recognizer_new()
+VoskBatchRecognizer *vosk_batch_recognizer_new(const char *model_path, const char *config)
 {
 #if HAVE_CUDA
-    return (VoskBatchRecognizer *)(new BatchRecognizer());
+    try {
+        return (VoskBatchRecognizer *)(new BatchRecognizer(model_path, config));
+    } catch (...) {
+        return nullptr;
+    }
 #else
     return NULL;
 #endif
@@ -204,6 +457,10 @@ void vosk_batch_recognizer_free(VoskBatchRecognizer *recognizer)
 void vosk_batch_recognizer_accept_waveform(VoskBatchRecognizer *recognizer, int id, const char *data, int length)
 {
 #if HAVE_CUDA
+    if (id < 0) {
+        KALDI_WARN << "Ignoring data of negative stream id " << id;
+        return;
+    }
     ((BatchRecognizer *)recognizer)->AcceptWaveform(id, data, length);
 #endif
 }
@@ -231,6 +488,21 @@ void vosk_batch_recognizer_pop(VoskBatchRecognizer *recognizer, int id)
 #endif
 }
 
+int vosk_batch_recognizer_next_result(VoskBatchRecognizer *recognizer, int timeout_ms)
+{
+#if HAVE_CUDA
+    uint64_t id;
+    if (((BatchRecognizer *)recognizer)->NextResult(&id, timeout_ms)) {
+        // Ids come from the int API, others can't be returned
+        if (id <= INT_MAX) {
+            return (int)id;
+        }
+        KALDI_WARN << "Stream id " << id << " is out of the range of the API";
+    }
+#endif
+    return -1;
+}
+
 void vosk_batch_recognizer_wait(VoskBatchRecognizer *recognizer)
 {
 #if HAVE_CUDA
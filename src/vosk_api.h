@@ -44,6 +44,43 @@ typedef struct VoskRecognizer VoskRecognizer;
  */
 typedef struct VoskBatchRecognizer VoskBatchRecognizer;
 
+
+/** Recognizer pool keeps prepared recognizers for reuse. Instead of creating
+ *  a recognizer for every call, acquire it from the pool and release it back
+ *  when done. */
+typedef struct VoskRecognizerPool VoskRecognizerPool;
+
+
+/** Model registry holds the current version of a model. Recognizers created
+ *  from the registry move to a new model when it is swapped in, so the model
+ *  can be updated without restarting the streams. */
+typedef struct VoskModelRegistry VoskModelRegistry;
+
+
+/** Type of the result passed to the asynchronous callback */
+typedef enum VoskResultType {
+    VOSK_RESULT_PARTIAL = 0,   /* partial result after a chunk of audio, see vosk_recognizer_partial_result */
+    VOSK_RESULT_ENDPOINT = 1,  /* result of the utterance ended by silence, see vosk_recognizer_result */
+    VOSK_RESULT_FINAL = 2      /* result after the end of the stream, see vosk_recognizer_final_result */
+} VoskResultType;
+
+
+/** Callback receiving results of the asynchronous recognizer
+ *
+ *  Called from the library threads. The result string is valid only
+ *  during the call. */
+typedef void (*VoskResultCallback)(void *user_data, int type, const char *result);
+
+
+/** Word of a structured result, see vosk_recognizer_result_words */
+typedef struct VoskWord {
+    const char *word;  /* word text */
+    int id;            /* word id in the model symbol table */
+    float start;       /* start time in seconds */
+    float end;         /* end time in seconds */
+    float conf;        /* confidence, 0 in alternatives */
+} VoskWord;
+
 /** Loads model data from the file and returns the model object
  *
  * @param model_path: the path of the model on the filesystem
@@ -51,6 +88,27 @@ typedef struct VoskBatchRecognizer VoskBatchRecognizer;
 VoskModel *vosk_model_new(const char *model_path);
 
 
+/** Loads a graph for the acoustic model of another model
+ *
+ *  Only the graph, the rescoring model and the RNNLM are loaded. The
+ *  acoustic model, i-vector extractor, feature configuration and
+ *  decoding options are shared with @param am_model, so many graphs
+ *  can be served with a single copy of the acoustic model in memory.
+ *  The graph must be built for the same acoustic model.
+ *
+ *  The graph folder has the same layout as a model folder with graph/,
+ *  rescore/ and rnnlm/ subfolders, or the old layout with HCLG.fst and
+ *  words.txt in the folder itself.
+ *
+ *  The acoustic model stays alive while the returned model is used,
+ *  @param am_model can be freed right after this call.
+ *
+ * @param am_model: the model to take the acoustic model from
+ * @param graph_path: the path of the graph on the filesystem
+ * @returns model object or NULL if problem occured */
+VoskModel *vosk_model_new_graph(VoskModel *am_model, const char *graph_path);
+
+
 /** Releases the model memory
  *
  *  The model object is reference-counted so if some recognizer
@@ -67,6 +125,56 @@ void vosk_model_free(VoskModel *model);
 int vosk_model_find_word(VoskModel *model, const char *word);
 
 
+/** Returns statistics of all recognizers of the model
+ *
+ *  The counters of a recognizer are added to the model after every
+ *  result and when the recognizer is released. The format is the same
+ *  as in vosk_recognizer_get_stats without the lattice sizes.
+ *
+ *  @param buffer - receives the statistics in JSON format, always terminated
+ *  @param size - size of the buffer
+ *  @returns the length of the statistics, if it is not smaller than the size
+ *           the statistics are truncated
+ */
+int vosk_model_get_stats(VoskModel *model, char *buffer, int size);
+
+
+/** Creates the model registry with the initial model
+ *
+ *  The registry takes its own reference, the model can be freed
+ *  with vosk_model_free right after this call.
+ *
+ *  @returns registry object or NULL if problem occured */
+VoskModelRegistry *vosk_model_registry_new(VoskModel *model);
+
+
+/** Makes the model current
+ *
+ *  Load the new model in the background with vosk_model_new or
+ *  vosk_model_new_graph and pass it here. New recognizers use it
+ *  right away. Existing recognizers switch to it at the next utterance
+ *  boundary, after an endpoint or the final result, the utterances in
+ *  progress finish with the old model. The old model is released by
+ *  the last recognizer using it.
+ *
+ *  The registry takes its own reference, the model can be freed
+ *  with vosk_model_free right after this call.
+ *
+ *  @returns the new version of the registry, the initial model is version 1 */
+int vosk_model_registry_swap(VoskModelRegistry *registry, VoskModel *model);
+
+
+/** Returns the current version of the registry */
+int vosk_model_registry_version(VoskModelRegistry *registry);
+
+
+/** Releases the registry
+ *
+ *  The registry is reference-counted, recognizers created from it
+ *  keep it alive until they are freed. */
+void vosk_model_registry_free(VoskModelRegistry *registry);
+
+
 /** Loads speaker model data from the file and returns the model object
  *
  * @param model_path: the path of the model on the filesystem
@@ -130,6 +238,22 @@ VoskRecognizer *vosk_recognizer_new_spk(VoskModel *model, float sample_rate, Vos
 VoskRecognizer *vosk_recognizer_new_grm(VoskModel *model, float sample_rate, const char *grammar);
 
 
+/** Creates the recognizer object which follows the current model of the registry
+ *
+ *  The recognizer starts with the current model and switches to a swapped
+ *  one at the utterance boundary. The phrase list and the hotwords are
+ *  applied to the new model again.
+ *
+ *  @param registry    VoskModelRegistry with the current model
+ *  @param sample_rate The sample rate of the audio you going to feed into the recognizer
+ *  @returns recognizer object or NULL if problem occured */
+VoskRecognizer *vosk_recognizer_new_registry(VoskModelRegistry *registry, float sample_rate);
+
+
+/** Same as above but the recognizer is created with the phrase list, see vosk_recognizer_new_grm */
+VoskRecognizer *vosk_recognizer_new_registry_grm(VoskModelRegistry *registry, float sample_rate, const char *grammar);
+
+
 /** Adds speaker model to already initialized recognizer
  *
  * Can add speaker recognition model to already created recognizer. Helps to initialize
@@ -150,6 +274,9 @@ void vosk_recognizer_set_spk_model(VoskRecognizer *recognizer, VoskSpkModel *spk
  *   }
  * </pre>
  *
+ * Without vosk_recognizer_set_words only the texts are returned and the lattice
+ * is not word-aligned, which makes the alternatives cheaper.
+ *
  * @param max_alternatives - maximum alternatives to return from recognition results
  */
 void vosk_recognizer_set_max_alternatives(VoskRecognizer *recognizer, int max_alternatives);
@@ -191,6 +318,102 @@ void vosk_recognizer_set_max_alternatives(VoskRecognizer *recognizer, int max_al
 void vosk_recognizer_set_words(VoskRecognizer *recognizer, int words);
 
 
+/** Enables incremental partial results
+ *
+ * By default every partial result contains the whole text of the current utterance.
+ * In incremental mode the older part of the text is returned once in the "stable"
+ * field and later partial results contain only the newer words after it:
+ *
+ * <pre>
+ * {
+ *   "partial" : "two three",
+ *   "stable" : "one"
+ * }
+ * </pre>
+ *
+ * Stable words are not repeated even if the decoder changes its best path later,
+ * the final result of the utterance contains the whole text as usual.
+ *
+ * @param incremental - boolean value
+ */
+void vosk_recognizer_set_incremental_partial(VoskRecognizer *recognizer, int incremental);
+
+
+/** Configures pruning of the RNNLM lattice rescoring
+ *
+ * Larger values explore more of the lattice and take more time at the end
+ * of every utterance. Defaults are 3.0 and 3000, non-positive values are ignored.
+ *
+ * @param beam - pruning beam of the lattice composition
+ * @param max_arcs - maximal number of arcs in the rescored lattice
+ */
+void vosk_recognizer_set_rescoring_pruning(VoskRecognizer *recognizer, float beam, int max_arcs);
+
+
+/** Configures the size of the audio chunks the decoder advances on
+ *
+ * Audio passed to accept_waveform is decoded in chunks of this size. Small chunks
+ * give lower latency of partial results and endpoints, large chunks give better
+ * throughput for offline processing. Default is 0.2 seconds.
+ *
+ * @param chunk_size - chunk size in seconds
+ */
+void vosk_recognizer_set_chunk_size(VoskRecognizer *recognizer, float chunk_size);
+
+
+/** Configures how often silence weights for i-vector estimation are updated
+ *
+ * Updating the weights needs the traceback of the current best path. By default
+ * it is done after every chunk, larger intervals save CPU on long inputs.
+ *
+ * @param interval - minimal amount of audio between updates in seconds, 0 to update after every chunk
+ */
+void vosk_recognizer_set_silence_weight_interval(VoskRecognizer *recognizer, float interval);
+
+
+/** Enables speaker vectors over sliding windows
+ *
+ * Vectors are computed while the audio arrives, every window only once, so the
+ * cost stays linear on long recordings. The vectors computed since the previous
+ * result are added to the next result as "spk_windows" with start and end times.
+ * Requires a speaker model.
+ *
+ * @param window - window length in seconds, 0 to disable windows (default)
+ * @param shift - interval between the starts of the windows in seconds
+ */
+void vosk_recognizer_set_spk_window(VoskRecognizer *recognizer, float window, float shift);
+
+
+/** Enables skipping of the silence between utterances
+ *
+ * An energy based detector runs in front of the feature extraction. After an
+ * endpoint, once the detector reports silence for a while, the audio is not
+ * decoded until speech starts again, which saves CPU on audio with long pauses.
+ * Word timestamps stay relative to the start of the audio. Loud noise and
+ * music are still decoded. Empty results for long silences are not produced
+ * while the audio is skipped.
+ *
+ * @param vad - 1 to enable, 0 to disable (default)
+ */
+void vosk_recognizer_set_vad(VoskRecognizer *recognizer, int vad);
+
+
+/** Sets phrases to boost in the results, like names or product codes
+ *
+ * The phrases are boosted in the lattice of the final results, so a phrase
+ * wins over similar sounding alternatives the decoder considered. The graph is
+ * not changed, setting up takes microseconds. Words have to be in the
+ * vocabulary of the model, phrases with unknown words are ignored. Partial
+ * results are not affected.
+ *
+ * @param hotwords - JSON array of phrases, each either a string or an object
+ *                   with the phrase and its boost in graph cost units (default 4),
+ *                   e.g. ["john smith", {"phrase": "acme pro", "boost": 8}].
+ *                   NULL or empty string removes the phrases.
+ */
+void vosk_recognizer_set_hotwords(VoskRecognizer *recognizer, const char *hotwords);
+
+
 /** Accept voice data
  *
  *  accept and process new chunk of voice data
@@ -255,6 +478,106 @@ const char *vosk_recognizer_partial_result(VoskRecognizer *recognizer);
 const char *vosk_recognizer_final_result(VoskRecognizer *recognizer);
 
 
+/** Returns the number of alternatives of the last result
+ *
+ *  The structured accessors describe the result last returned by
+ *  vosk_recognizer_result, vosk_recognizer_partial_result or
+ *  vosk_recognizer_final_result, so the words, times and confidences
+ *  don't have to be parsed from JSON. The memory is owned by the recognizer
+ *  and stays valid until the next result is produced.
+ *
+ *  Without alternatives the result has a single entry, partial results
+ *  have a single entry with the text and no words.
+ */
+int vosk_recognizer_result_num_alternatives(VoskRecognizer *recognizer);
+
+
+/** Returns the text of an alternative of the last result
+ *
+ *  @returns the text or NULL if the alternative doesn't exist */
+const char *vosk_recognizer_result_text(VoskRecognizer *recognizer, int alternative);
+
+
+/** Returns the confidence of an alternative of the last result
+ *
+ *  @returns the confidence of the alternative, 0 if there are no alternatives */
+float vosk_recognizer_result_confidence(VoskRecognizer *recognizer, int alternative);
+
+
+/** Returns the words of an alternative of the last result
+ *
+ *  Words are available regardless of vosk_recognizer_set_words. Without it
+ *  the times of the words of alternatives are approximate.
+ *
+ *  @param num_words - receives the number of words
+ *  @returns array of the words
+ */
+const VoskWord *vosk_recognizer_result_words(VoskRecognizer *recognizer, int alternative, int *num_words);
+
+
+/** Returns the speaker vector of the last result
+ *
+ *  @param dim - receives the dimension of the vector, 0 if there is no vector
+ *  @param num_frames - receives the number of frames used to compute the vector
+ *  @returns the vector or NULL
+ */
+const float *vosk_recognizer_result_spk(VoskRecognizer *recognizer, int *dim, int *num_frames);
+
+
+/** Returns the number of speaker window vectors of the last result
+ *
+ *  See vosk_recognizer_set_spk_window */
+int vosk_recognizer_result_num_spk_windows(VoskRecognizer *recognizer);
+
+
+/** Returns a speaker window vector of the last result
+ *
+ *  @param start - receives the start time of the window in seconds
+ *  @param end - receives the end time of the window in seconds
+ *  @param dim - receives the dimension of the vector
+ *  @returns the vector or NULL if the window doesn't exist
+ */
+const float *vosk_recognizer_result_spk_window(VoskRecognizer *recognizer, int index,
+                                               float *start, float *end, int *dim);
+
+
+/** Enables the timers of the recognizer statistics
+ *
+ *  The counters of audio, frames and results are always collected. The
+ *  time spent in feature extraction, decoding, silence weighting, lattice
+ *  generation, rescoring, MBR or N-best search, speaker vectors and
+ *  serialization is measured only when enabled. Disabled by default.
+ */
+void vosk_recognizer_set_stats(VoskRecognizer *recognizer, int enable);
+
+
+/** Returns statistics of the recognizer
+ *
+ *  <pre>
+ *  {
+ *    "audio_seconds" : 12.300000,
+ *    "collect_time" : true,
+ *    "frames_decoded" : 410,
+ *    "lattice_states" : 1200,
+ *    "partial_results" : 61,
+ *    "raw_lattice_states" : 12876,
+ *    "results" : 3,
+ *    "rtf" : 0.081000,
+ *    "time" : {
+ *      "decode" : 0.700000,
+ *      ...
+ *    }
+ *  }
+ *  </pre>
+ *
+ *  Lattice sizes are the ones of the last result. The decoding time
+ *  includes the nnet3 computation.
+ *
+ *  @returns the statistics in JSON format, valid until the next call
+ */
+const char *vosk_recognizer_get_stats(VoskRecognizer *recognizer);
+
+
 /** Resets the recognizer
  *
  *  Resets current results so the recognition can continue from scratch */
@@ -266,6 +589,79 @@ void vosk_recognizer_reset(VoskRecognizer *recognizer);
  *  Underlying model is also unreferenced and if needed released */
 void vosk_recognizer_free(VoskRecognizer *recognizer);
 
+
+/** Sets the callback for the asynchronous mode
+ *
+ *  Must be set before the audio is queued.
+ *  @param callback  function called with every result
+ *  @param user_data pointer passed to the callback as is */
+void vosk_recognizer_set_callback(VoskRecognizer *recognizer, VoskResultCallback callback, void *user_data);
+
+
+/** Queues voice data for asynchronous processing
+ *
+ *  Returns immediately, the data is copied. Threads of the library decode
+ *  the queued audio of every recognizer in order and pass a partial or an
+ *  endpoint result to the callback after each call. Don't mix with the
+ *  synchronous functions on the same recognizer until vosk_recognizer_wait_async
+ *  returns.
+ *
+ *  @param data - audio data in PCM 16-bit mono format
+ *  @param length - length of the audio data
+ *  @returns 0 if data is queued, -1 if exception occured */
+int vosk_recognizer_accept_waveform_async(VoskRecognizer *recognizer, const char *data, int length);
+
+
+/** Queues the end of the stream, the callback receives the final result */
+int vosk_recognizer_finish_async(VoskRecognizer *recognizer);
+
+
+/** Waits until all the queued audio of the recognizer is processed */
+void vosk_recognizer_wait_async(VoskRecognizer *recognizer);
+
+
+/** Sets the number of threads for the asynchronous processing
+ *
+ *  Threads are shared by all recognizers, default is the number of cores.
+ *  The pool only grows, lowering the number has no effect once threads are started. */
+void vosk_set_async_threads(int num_threads);
+
+
+/** Creates the pool of recognizers
+ *
+ *  @param model       VoskModel containing static data for recognizers
+ *  @param sample_rate The sample rate of the audio you going to feed into the recognizers
+ *  @param size        Number of recognizers to create in advance. Pool keeps at most
+ *                     this number of idle recognizers.
+ *  @returns pool object or NULL if problem occured */
+VoskRecognizerPool *vosk_recognizer_pool_new(VoskModel *model, float sample_rate, int size);
+
+
+/** Same as above but recognizers are created with the phrase list, see vosk_recognizer_new_grm */
+VoskRecognizerPool *vosk_recognizer_pool_new_grm(VoskModel *model, float sample_rate, int size, const char *grammar);
+
+
+/** Takes a recognizer from the pool
+ *
+ *  If all recognizers are in use a new one is created.
+ *  @returns recognizer object or NULL if problem occured */
+VoskRecognizer *vosk_recognizer_pool_acquire(VoskRecognizerPool *pool);
+
+
+/** Returns the recognizer to the pool
+ *
+ *  Waits until the pending asynchronous work of the recognizer is finished,
+ *  then the recognizer is reset and prepared for the next utterance. The
+ *  settings like max alternatives or words are kept, the result callback
+ *  is removed. Don't use the recognizer after release. */
+void vosk_recognizer_pool_release(VoskRecognizerPool *pool, VoskRecognizer *recognizer);
+
+
+/** Releases the pool and idle recognizers
+ *
+ *  Recognizers acquired from the pool stay valid and should be freed with vosk_recognizer_free */
+void vosk_recognizer_pool_free(VoskRecognizerPool *pool);
+
 /** Set log level for Kaldi messages
  *
  *  @param log_level the level
@@ -275,6 +671,32 @@ void vosk_recognizer_free(VoskRecognizer *recognizer);
  */
 void vosk_set_log_level(int log_level);
 
+
+/** Sets the number of memory arenas of the allocator
+ *
+ *  Decoding allocates many small objects for tokens and lattices. With many
+ *  recognizer threads they contend for the allocator once there are more
+ *  threads than arenas. Setting the number of arenas to the number of
+ *  recognizer threads gives every thread its own arena. Must be called
+ *  before the recognizer threads start.
+ *  Only has an effect with glibc, other platforms use their own allocator.
+ *
+ *  @param arenas maximal number of arenas, 0 for the default of 8 per core
+ */
+void vosk_set_allocator_arenas(int arenas);
+
+
+/** Returns the free memory of the allocator to the system
+ *
+ *  Long-running processes keep the memory of finished utterances in the
+ *  arenas, fragmented between live objects. Call this at idle moments,
+ *  for example after the calls of a batch are finished. It locks all
+ *  arenas for the time it takes, so it shouldn't be called after every
+ *  utterance.
+ *  Only has an effect with glibc.
+ */
+void vosk_release_memory();
+
 /**
  *  Init, automatically select a CUDA device and allow multithreading.
  *  Must be called once from the main thread.
@@ -291,14 +713,24 @@ void vosk_gpu_thread_init();
 
 /** Creates the batch recognizer object
  *
+ *  @param model_path path to the model folder
+ *  @param config     JSON object with the pipeline settings or NULL for defaults,
+ *                    for example "{"max_batch_size": 64, "num_channels": 1000}".
+ *                    Supported keys are max_batch_size, num_channels,
+ *                    num_worker_threads, frames_per_chunk, max_active, beam,
+ *                    lattice_beam, batcher_timeout in seconds and
+ *                    num_post_processing_threads for lattice rescoring.
  *  @returns recognizer object or NULL if problem occured */
-VoskBatchRecognizer *vosk_batch_recognizer_new();
+VoskBatchRecognizer *vosk_batch_recognizer_new(const char *model_path, const char *config);
 
 /** Releases batch recognizer object
  *  Underlying model is also unreferenced and if needed released */
 void vosk_batch_recognizer_free(VoskBatchRecognizer *recognizer);
 
-/** Accept batch voice data */
+/** Accept batch voice data
+ *
+ *  @param id - id of the stream, must be non-negative. Data of negative
+ *              ids is ignored, -1 is the timeout of next_result */
 void vosk_batch_recognizer_accept_waveform(VoskBatchRecognizer *recognizer, int id, const char *data, int length);
 
 /** Closes the stream */
@@ -310,6 +742,17 @@ const char *vosk_batch_recognizer_front_result(VoskBatchRecognizer *recognizer,
 /** Release and free first retrieved result */
 void vosk_batch_recognizer_pop(VoskBatchRecognizer *recognizer, int id);
 
+/** Waits for the next result of any stream
+ *
+ *  A stream is announced once when its first result arrives, in the order
+ *  results arrive. Retrieve the results with vosk_batch_recognizer_front_result
+ *  and vosk_batch_recognizer_pop, a stream with results left after the pop
+ *  is announced again. Clients that only use front_result and pop don't
+ *  need to call this function.
+ *  @param timeout_ms - maximal time to wait in milliseconds
+ *  @returns non-negative id of the stream with the result or -1 on timeout */
+int vosk_batch_recognizer_next_result(VoskBatchRecognizer *recognizer, int timeout_ms);
+
 /** Wait for the processing */
 void vosk_batch_recognizer_wait(VoskBatchRecognizer *recognizer);
 
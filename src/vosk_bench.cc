@@ -0,0 +1,516 @@
+// Copyright 2021 Alpha Cephei Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmark of the recognizers over a directory of WAV files. Runs the
+// requested number of recognizers in parallel and prints the real-time
+// factor, memory, model load time, result latencies and the time spent
+// in the stages of the recognizer.
+
+#include "recognizer.h"
+#include "model.h"
+#include "vosk_api.h"
+#include "feat/wave-reader.h"
+#include "util/parse-options.h"
+#if HAVE_CUDA
+#include "batch_recognizer.h"
+#include "cudamatrix/cu-device.h"
+#endif
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+struct WavFile {
+    string path;
+    BaseFloat sample_rate;
+    Vector<BaseFloat> samples; // 16-bit range like the recognizer expects
+};
+
+struct StreamStats {
+    double audio_seconds = 0;
+    double processing_seconds = 0;
+    vector<double> partial_latency;
+    vector<double> endpoint_latency;
+    vector<double> final_latency;
+    RecognizerStats recognizer;
+
+    void Add(const StreamStats &other) {
+        audio_seconds += other.audio_seconds;
+        processing_seconds += other.processing_seconds;
+        partial_latency.insert(partial_latency.end(), other.partial_latency.begin(), other.partial_latency.end());
+        endpoint_latency.insert(endpoint_latency.end(), other.endpoint_latency.begin(), other.endpoint_latency.end());
+        final_latency.insert(final_latency.end(), other.final_latency.begin(), other.final_latency.end());
+        recognizer.Add(other.recognizer);
+    }
+};
+
+static vector<string> ListWavFiles(const string &dir)
+{
+    vector<string> files;
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        KALDI_ERR << "Can't open directory " << dir;
+    }
+    while (struct dirent *entry = readdir(d)) {
+        string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".wav") == 0) {
+            files.push_back(dir + "/" + name);
+        }
+    }
+    closedir(d);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+static void ReadWavFile(const string &path, WavFile *wav)
+{
+    std::ifstream is(path, std::ios::binary);
+    WaveData wave;
+    wave.Read(is);
+    if (wave.Data().NumRows() > 1) {
+        KALDI_WARN << "Using the first channel of " << path;
+    }
+    wav->path = path;
+    wav->sample_rate = wave.SampFreq();
+    wav->samples = wave.Data().Row(0);
+}
+
+// Current resident memory in bytes
+static int64 ResidentMemory()
+{
+    std::ifstream is("/proc/self/statm");
+    int64 size = 0, resident = 0;
+    is >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double Seconds(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+// Appends the words of the last result
+static void AddResultWords(const Recognizer &rec, vector<string> *words)
+{
+    if (words == nullptr || rec.NumResultAlternatives() == 0)
+        return;
+    std::istringstream is(rec.ResultText(0));
+    string word;
+    while (is >> word) {
+        words->push_back(word);
+    }
+}
+
+static bool vad = false;
+
+static void DecodeFile(Model *model, const WavFile &wav, int chunk_samples, bool realtime,
+                       StreamStats *stats, vector<string> *words = nullptr)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Recognizer rec(model, wav.sample_rate);
+    rec.SetCollectStats(true);
+    rec.SetVad(vad);
+    Clock::time_point start = Clock::now();
+
+    for (int i = 0; i < wav.samples.Dim(); i += chunk_samples) {
+        int len = std::min(chunk_samples, wav.samples.Dim() - i);
+        if (realtime) {
+            std::this_thread::sleep_until(start + std::chrono::duration<double>((i + len) / wav.sample_rate));
+        }
+
+        Clock::time_point t = Clock::now();
+        if (rec.AcceptWaveform(wav.samples.Data() + i, len)) {
+            rec.Result();
+            AddResultWords(rec, words);
+            stats->endpoint_latency.push_back(Seconds(Clock::now() - t));
+        } else {
+            rec.PartialResult();
+            stats->partial_latency.push_back(Seconds(Clock::now() - t));
+        }
+    }
+
+    Clock::time_point t = Clock::now();
+    rec.FinalResult();
+    stats->final_latency.push_back(Seconds(Clock::now() - t));
+    AddResultWords(rec, words);
+
+    stats->audio_seconds += wav.samples.Dim() / wav.sample_rate;
+    stats->processing_seconds += Seconds(Clock::now() - start);
+    stats->recognizer.Add(rec.Stats());
+}
+
+static size_t EditDistance(const vector<string> &a, const vector<string> &b)
+{
+    vector<size_t> prev(b.size() + 1), cur(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); j++) {
+        prev[j] = j;
+    }
+    for (size_t i = 1; i <= a.size(); i++) {
+        cur[0] = i;
+        for (size_t j = 1; j <= b.size(); j++) {
+            cur[j] = std::min({ prev[j] + 1, cur[j - 1] + 1, prev[j - 1] + (a[i - 1] != b[j - 1]) });
+        }
+        std::swap(prev, cur);
+    }
+    return prev[b.size()];
+}
+
+// Decodes all files with the float and the int8 acoustic model in a single
+// stream. The float results are the reference for the error rate, the
+// speed is compared on the decode time which includes the nnet.
+static void CompareQuantized(const string &model_dir, const vector<WavFile> &wavs, BaseFloat chunk_size)
+{
+    const char *names[] = { "float", "int8" };
+    StreamStats stats[2];
+    vector<vector<string> > words[2];
+    for (int m = 0; m < 2; m++) {
+        vector<string> args;
+        args.push_back(string("--quantize-acoustic-model=") + (m ? "true" : "false"));
+        Model *model = new Model(model_dir.c_str(), args);
+        words[m].resize(wavs.size());
+        for (size_t f = 0; f < wavs.size(); f++) {
+            int chunk_samples = std::max(1, static_cast<int>(chunk_size * wavs[f].sample_rate));
+            DecodeFile(model, wavs[f], chunk_samples, false, &stats[m], &words[m][f]);
+        }
+        model->Unref();
+    }
+
+    size_t errors = 0, reference_words = 0;
+    for (size_t f = 0; f < wavs.size(); f++) {
+        errors += EditDistance(words[0][f], words[1][f]);
+        reference_words += words[0][f].size();
+    }
+
+    printf("\nQuantized acoustic model\n");
+    for (int m = 0; m < 2; m++) {
+        printf("  %-6s RTF %.4f  decode %.3f s\n", names[m],
+               stats[m].processing_seconds / stats[m].audio_seconds, stats[m].recognizer.decode);
+    }
+    printf("  decode speedup   %.2f x\n", stats[0].recognizer.decode / stats[1].recognizer.decode);
+    printf("  WER vs float     %.2f%% (%zu errors in %zu words)\n",
+           reference_words ? 100.0 * errors / reference_words : 0.0, errors, reference_words);
+}
+
+// Decodes all files in parallel streams with the looped acoustic model and
+// with the chunks of the streams batched. The looped results are the
+// reference for the error rate.
+static void CompareBatched(const string &model_dir, const vector<WavFile> &wavs, BaseFloat chunk_size,
+                           int32 num_streams, int32 nnet_batch_size)
+{
+    const char *names[] = { "looped", "batched" };
+    double wall_time[2];
+    StreamStats stats[2];
+    vector<vector<string> > words[2];
+    for (int m = 0; m < 2; m++) {
+        vector<string> args;
+        args.push_back("--nnet-batch-size=" + std::to_string(m ? nnet_batch_size : 0));
+        Model *model = new Model(model_dir.c_str(), args);
+        words[m].resize(wavs.size());
+
+        std::atomic<size_t> next_file(0);
+        vector<StreamStats> stream_stats(num_streams);
+        vector<std::thread> threads;
+        Timer timer;
+        for (int i = 0; i < num_streams; i++) {
+            threads.emplace_back([&, i]() {
+                for (size_t f = next_file++; f < wavs.size(); f = next_file++) {
+                    int chunk_samples = std::max(1, static_cast<int>(chunk_size * wavs[f].sample_rate));
+                    DecodeFile(model, wavs[f], chunk_samples, false, &stream_stats[i], &words[m][f]);
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        wall_time[m] = timer.Elapsed();
+        for (const StreamStats &s : stream_stats) {
+            stats[m].Add(s);
+        }
+        model->Unref();
+    }
+
+    size_t errors = 0, reference_words = 0;
+    for (size_t f = 0; f < wavs.size(); f++) {
+        errors += EditDistance(words[0][f], words[1][f]);
+        reference_words += words[0][f].size();
+    }
+
+    printf("\nBatched acoustic model, %d streams, batches of %d chunks\n", num_streams, nnet_batch_size);
+    for (int m = 0; m < 2; m++) {
+        printf("  %-7s throughput %.2f x real time  RTF per stream %.4f  decode %.3f s\n", names[m],
+               stats[m].audio_seconds / wall_time[m],
+               stats[m].processing_seconds / stats[m].audio_seconds, stats[m].recognizer.decode);
+    }
+    printf("  throughput gain  %.2f x\n", wall_time[0] / wall_time[1]);
+    printf("  WER vs looped    %.2f%% (%zu errors in %zu words)\n",
+           reference_words ? 100.0 * errors / reference_words : 0.0, errors, reference_words);
+}
+
+#if HAVE_CUDA
+static void DecodeBatch(const string &model_dir, const vector<WavFile> &wavs, int chunk_samples)
+{
+    Timer timer;
+    BatchRecognizer rec(model_dir.c_str(), nullptr);
+    KALDI_LOG << "Batch recognizer load time " << timer.Elapsed() << " s";
+
+    double audio_seconds = 0;
+    timer.Reset();
+    // Streams are fed in turns, one chunk each, like independent clients
+    vector<int> offsets(wavs.size(), 0);
+    vector<std::vector<short> > data(wavs.size());
+    for (size_t i = 0; i < wavs.size(); i++) {
+        data[i].resize(wavs[i].samples.Dim());
+        for (int j = 0; j < wavs[i].samples.Dim(); j++) {
+            data[i][j] = wavs[i].samples(j);
+        }
+        audio_seconds += wavs[i].samples.Dim() / wavs[i].sample_rate;
+    }
+    bool done = false;
+    while (!done) {
+        done = true;
+        for (size_t i = 0; i < wavs.size(); i++) {
+            int len = std::min<int>(chunk_samples, data[i].size() - offsets[i]);
+            if (len <= 0)
+                continue;
+            done = false;
+            rec.AcceptWaveform(i + 1, (const char *)(data[i].data() + offsets[i]), len * 2);
+            offsets[i] += len;
+            if (offsets[i] == (int)data[i].size()) {
+                rec.FinishStream(i + 1);
+            }
+        }
+    }
+    rec.WaitForCompletion();
+
+    double elapsed = timer.Elapsed();
+    int num_results = 0;
+    uint64_t id;
+    while (rec.NextResult(&id, 0)) {
+        rec.Pop(id);
+        num_results++;
+    }
+
+    printf("\nBatch recognizer\n");
+    printf("  streams          %zu\n", wavs.size());
+    printf("  results          %d\n", num_results);
+    printf("  audio            %.1f s\n", audio_seconds);
+    printf("  wall time        %.3f s\n", elapsed);
+    printf("  RTF              %.4f\n", elapsed / audio_seconds);
+}
+#endif
+
+static void PrintLatency(const char *name, vector<double> &latency)
+{
+    static const double buckets[] = { 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0 };
+    static const int num_buckets = sizeof(buckets) / sizeof(buckets[0]);
+
+    if (latency.empty()) {
+        printf("  %-10s no results\n", name);
+        return;
+    }
+    std::sort(latency.begin(), latency.end());
+    size_t n = latency.size();
+    printf("  %-10s count %zu  p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms\n", name, n,
+           latency[n / 2] * 1000, latency[n * 9 / 10] * 1000, latency[n * 99 / 100] * 1000,
+           latency.back() * 1000);
+
+    size_t prev = 0;
+    for (int i = 0; i <= num_buckets; i++) {
+        size_t count = i < num_buckets
+            ? std::upper_bound(latency.begin(), latency.end(), buckets[i]) - latency.begin()
+            : n;
+        if (count > prev) {
+            if (i < num_buckets)
+                printf("    <= %6.0f ms  %zu\n", buckets[i] * 1000, count - prev);
+            else
+                printf("     > %6.0f ms  %zu\n", buckets[num_buckets - 1] * 1000, count - prev);
+        }
+        prev = count;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *usage =
+        "Benchmarks Vosk recognizers on a directory of WAV files\n"
+        "\n"
+        "Usage: vosk_bench [options] <model-dir> <wav-dir>\n"
+        "e.g.: vosk_bench --streams=8 model test/wavs\n";
+
+    ParseOptions po(usage);
+    int32 num_streams = 1;
+    BaseFloat chunk_size = 0.2;
+    bool realtime = false;
+    bool batch = false;
+    bool quantize = false;
+    bool compare_quantized = false;
+    int32 nnet_batch_size = 0;
+    bool compare_batched = false;
+    int32 allocator_arenas = 0;
+    po.Register("streams", &num_streams, "Number of recognizers decoding in parallel");
+    po.Register("chunk-size", &chunk_size, "Seconds of audio passed to every AcceptWaveform call");
+    po.Register("realtime", &realtime, "Feed the audio at the real-time rate instead of as fast as possible");
+    po.Register("batch", &batch, "Also benchmark the GPU batch recognizer");
+    po.Register("allocator-arenas", &allocator_arenas, "Maximal number of malloc arenas, "
+                "0 for the glibc default");
+    po.Register("vad", &vad, "Skip the silence between utterances");
+    po.Register("quantize", &quantize, "Load the acoustic model quantized to int8");
+    po.Register("compare-quantized", &compare_quantized, "Also compare the speed and the "
+                "results of the float and the int8 acoustic model");
+    po.Register("nnet-batch-size", &nnet_batch_size, "Run the acoustic model on the chunks "
+                "of the streams in batches of this size, 0 to run every stream separately");
+    po.Register("compare-batched", &compare_batched, "Also compare the throughput and the "
+                "results of the looped and the batched acoustic model, batches of "
+                "--nnet-batch-size chunks or of --streams chunks if it is not set");
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 2) {
+        po.PrintUsage();
+        return 1;
+    }
+    string model_dir = po.GetArg(1);
+    string wav_dir = po.GetArg(2);
+    if (allocator_arenas > 0) {
+        vosk_set_allocator_arenas(allocator_arenas);
+    }
+
+    try {
+        vector<WavFile> wavs;
+        for (const string &path : ListWavFiles(wav_dir)) {
+            WavFile wav;
+            ReadWavFile(path, &wav);
+            wavs.push_back(wav);
+        }
+        if (wavs.empty()) {
+            KALDI_ERR << "No WAV files in " << wav_dir;
+        }
+
+        int64 memory_start = ResidentMemory();
+        Timer timer;
+        vector<string> model_args;
+        if (quantize) {
+            model_args.push_back("--quantize-acoustic-model=true");
+        }
+        if (nnet_batch_size > 0) {
+            model_args.push_back("--nnet-batch-size=" + std::to_string(nnet_batch_size));
+        }
+        Model *model = new Model(model_dir.c_str(), model_args);
+        double load_time = timer.Elapsed();
+        int64 memory_model = ResidentMemory();
+
+        // Every stream takes the next file until all of them are decoded
+        std::atomic<size_t> next_file(0);
+        std::atomic<int64> memory_peak(memory_model);
+        std::atomic<bool> finished(false);
+        vector<StreamStats> stats(num_streams);
+        vector<std::thread> threads;
+
+        timer.Reset();
+        for (int i = 0; i < num_streams; i++) {
+            threads.emplace_back([&, i]() {
+                for (size_t f = next_file++; f < wavs.size(); f = next_file++) {
+                    int chunk_samples = std::max(1, static_cast<int>(chunk_size * wavs[f].sample_rate));
+                    DecodeFile(model, wavs[f], chunk_samples, realtime, &stats[i]);
+                }
+            });
+        }
+        std::thread memory_monitor([&]() {
+            while (!finished) {
+                int64 memory = ResidentMemory();
+                if (memory > memory_peak)
+                    memory_peak = memory;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        });
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        double wall_time = timer.Elapsed();
+        finished = true;
+        memory_monitor.join();
+
+        StreamStats total;
+        for (const StreamStats &s : stats) {
+            total.Add(s);
+        }
+
+        printf("Model load time    %.3f s\n", load_time);
+        printf("Model memory       %.1f MB\n", (memory_model - memory_start) / 1048576.0);
+        printf("\nRecognizers\n");
+        printf("  streams          %d\n", num_streams);
+        printf("  files            %zu\n", wavs.size());
+        printf("  audio            %.1f s\n", total.audio_seconds);
+        printf("  wall time        %.3f s\n", wall_time);
+        printf("  RTF per stream   %.4f\n", total.processing_seconds / total.audio_seconds);
+        printf("  throughput       %.2f x real time\n", total.audio_seconds / wall_time);
+        printf("  memory peak      %.1f MB\n", memory_peak / 1048576.0);
+        printf("  memory / stream  %.1f MB\n", (memory_peak - memory_model) / 1048576.0 / num_streams);
+
+        printf("\nLatency\n");
+        PrintLatency("partial", total.partial_latency);
+        PrintLatency("endpoint", total.endpoint_latency);
+        PrintLatency("final", total.final_latency);
+
+        const RecognizerStats &t = total.recognizer;
+        double busy = t.TotalTime();
+        const std::pair<const char *, double> stages[] = {
+            { "features", t.features },
+            { "decode", t.decode },
+            { "silence weights", t.silence_weights },
+            { "lattice", t.lattice },
+            { "rescoring", t.rescoring },
+            { "mbr / nbest", t.mbr },
+            { "speaker", t.speaker },
+            { "serialization", t.serialization },
+        };
+        printf("\nTime breakdown, decode includes nnet3\n");
+        for (const auto &stage : stages) {
+            printf("  %-16s %8.3f s %5.1f%%\n", stage.first, stage.second, 100 * stage.second / busy);
+        }
+        printf("  frames decoded   %ld\n", (long)t.frames_decoded);
+        printf("  skipped silence  %.1f s\n", t.skipped_seconds);
+
+        model->Unref();
+
+        if (compare_quantized) {
+            CompareQuantized(model_dir, wavs, chunk_size);
+        }
+
+        if (compare_batched) {
+            CompareBatched(model_dir, wavs, chunk_size, num_streams,
+                           nnet_batch_size > 0 ? nnet_batch_size : num_streams);
+        }
+
+        if (batch) {
+#if HAVE_CUDA
+            kaldi::CuDevice::Instantiate().SelectGpuId("yes");
+            kaldi::CuDevice::Instantiate().AllowMultithreading();
+            DecodeBatch(model_dir, wavs, static_cast<int>(chunk_size * wavs[0].sample_rate));
+#else
+            KALDI_WARN << "Built without CUDA, skipping the batch recognizer";
+#endif
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        return 1;
+    }
+    return 0;
+}